@@ -0,0 +1,72 @@
+#!/bin/sh
+# bench.sh - carving benchmark for midi-carver
+#  builds carver and mkimage, plants MIDIs in an image of each filler type,
+#  carves it and reports speed, peak memory and how much was recovered
+#  against mkimage's ground truth
+#
+#  usage: ./bench.sh [size in MB] [carver options...]
+#   e.g.  ./bench.sh 1024 -j 8
+#
+#  Images are carved straight after being generated, so they come from
+#  the page cache; drop caches first if you want to measure the disk.
+#  Set CC or CFLAGS to change how the two programs are built, and KEEP=1
+#  to keep the work directory.
+
+set -e
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+SIZE=${1:-256}
+[ $# -gt 0 ] && shift
+
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/midibench.XXXXXX")
+if [ -z "$KEEP" ]; then
+	trap 'rm -rf "$WORK"' EXIT
+else
+	echo "Keeping $WORK"
+fi
+
+$CC $CFLAGS -pthread -o "$WORK/carver" "$HERE/carver.c"
+$CC $CFLAGS -o "$WORK/mkimage" "$HERE/mkimage.c"
+
+printf '%-7s %8s %9s %10s %10s %9s %12s %12s %6s\n' \
+	filler MB seconds MB/s files/s "RSS MB" recovered exact extra
+
+for FILL in random zero text; do
+	DIR="$WORK/$FILL"
+	mkdir "$DIR"
+	"$WORK/mkimage" -s "$SIZE" -f "$FILL" "$DIR/img" > /dev/null
+
+	START=$(date +%s.%N)
+	if [ -x /usr/bin/time ]; then
+		/usr/bin/time -v -o "$DIR/time" "$WORK/carver" -L 1 -M "$DIR/manifest.csv" "$@" "$DIR/img" > "$DIR/log"
+		RSS=$(sed -n 's/.*Maximum resident set size (kbytes): *//p' "$DIR/time")
+	else
+		"$WORK/carver" -L 1 -M "$DIR/manifest.csv" "$@" "$DIR/img" > "$DIR/log"
+		RSS=$(sed -n 's/^INFO: Peak RSS \([0-9]*\) KB$/\1/p' "$DIR/log")
+	fi
+	END=$(date +%s.%N)
+
+	# recovered: a record at a planted offset with the expected status
+	# exact: the file matches the truth byte for byte (where it's known)
+	# extra: records at offsets nothing was planted at
+	awk -F, -v start="$START" -v end="$END" -v size="$SIZE" -v rss="${RSS:-0}" -v fill="$FILL" '
+		FNR == 1 { next }
+		FNR == NR { status[$1] = $3; hash[$1] = $5; planted++; if ($5 != "") known++; next }
+		{
+			files++
+			if (!($3 in status)) { extra++; next }
+			if ($2 == status[$3]) recovered++
+			if (hash[$3] != "" && $10 == hash[$3]) exact++
+		}
+		END {
+			t = end - start
+			if (t <= 0) t = 0.000001
+			printf "%-7s %8d %9.2f %10.1f %10.0f %9.1f %6d/%-5d %6d/%-5d %6d\n",
+				fill, size, t, size / t, files / t, rss / 1024,
+				recovered, planted, exact, known, extra
+		}' "$DIR/img.truth" "$DIR/manifest.csv"
+
+	rm -rf "$DIR/mcut-out" "$DIR/img"
+done
@@ -12,396 +12,3810 @@
 //   * looks for an MThd or MTrk in the middle of a running MThd, and
 //       creates two files
 
+#define _GNU_SOURCE	// SEEK_HOLE, SEEK_DATA
+#include <errno.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 
 #include "libgen.h"
+#include "sys/mman.h"
+#include "sys/resource.h"
 #include "sys/stat.h"
+#include "sys/uio.h"
+
+#include "decomp.h"
+#include "sigscan.h"
+#include "uring.h"
+#include "xxh64.h"
+
+// how far ahead of the scan pointer we ask the kernel to read
+#define PREFETCH_AHEAD (64UL * 1024 * 1024)
+
+// most bytes handed to the signature scanner in one call, so readahead
+//  hints keep up even when there are no hits for a long way, and zero runs
+//  past the start of a step are still found and skipped
+#define SCAN_STEP (64L * 1024)
+
+// a mapped image is indexed and carved this many bytes at a time (or more,
+//  to give every thread of a big pool a few chunks), so checkpoints come
+//  throughout the scan instead of only once pass one has read everything
+#define MAP_SLICE (1024L * 1024 * 1024)
+
+// defaults for stream mode, in MB
+#define DEFAULT_MAX_MEMORY 256
+#define DEFAULT_WINDOW 16
+
+// --uring: bytes per read, and how many reads may be in flight at once
+#define IO_CHUNK (1024L * 1024)
+#define IO_DEPTH 64
+
+// O_DIRECT wants buffers, offsets and lengths in multiples of this
+#define IO_ALIGN 4096L
+
+// default size of the pieces handed to worker threads, in KB
+#define DEFAULT_CHUNK 65536
+
+// default number of finished MIDIs that may wait for the writer thread
+#define DEFAULT_QUEUE 64
+
+// arenas grow in blocks of this many bytes
+#define ARENA_BLOCK 4096
+
+// orphan MTrks whose first track scores below this are ignored
+#define DEFAULT_MIN_SCORE 32
+
+// seconds between checkpoints
+#define DEFAULT_CHECKPOINT 60
+
+// seconds between progress reports when only a stats file is asked for
+#define DEFAULT_PROGRESS 5
+
+// name of the checkpoint file in the output directory
+#define CHECKPOINT_NAME "carver.ckpt"
+
+// default number of images carved at once in a batch
+#define DEFAULT_IMAGES 4
+
+// in a batch, each image's manifest records go here in its directory
+//  until they're joined
+#define MANIFEST_PART "manifest.part"
+
+#define MANIFEST_HEADER "file,status,offset,consumed,length,tracks_expected,tracks_found,lost,damage,xxh64,carve_ns,write_ns,written,dup_of"
+
+// Why a carve isn't a clean copy of the original file, for the manifest.
+//  Bit k is named by dmg_names[k].
+#define DMG_HEADER_SIZE 0x0001	// MThd length field isn't 6
+#define DMG_BAD_TYPE 0x0002	// MIDI type isn't 0-2
+#define DMG_TYPE_FIXED 0x0004	// type 0 with several tracks, written as type 1
+#define DMG_ORPHAN 0x0008	// no MThd; a default one was generated
+#define DMG_TRUNCATED 0x0010	// data ran out before the last track
+#define DMG_COLLISION 0x0020	// ran into another MThd before the last track
+#define DMG_LOST_SYNC 0x0040	// an MTrk was missing, skipped ahead to the next one
+#define DMG_NO_RESYNC 0x0080	// an MTrk was missing and nothing followed it
+#define DMG_CLAMPED 0x0100	// a track's size ran past the data
+#define DMG_SAVED_OVER 0x0200	// an MThd turned up inside a track
+#define DMG_EOT_MOVED 0x0400	// end-of-track wasn't where the size said
+#define DMG_BAD_EVENTS 0x0800	// cut after the last event that made sense
+#define DMG_NO_EOT 0x1000	// appended an end-of-track
+#define DMG_PARTIAL_EOT 0x2000	// ends in FF 2F 00, but the events don't lead to it
+
+static const char *dmg_names[] = {
+	"header_size","bad_type","type_fixed","orphan","truncated","collision",
+	"lost_sync","no_resync","clamped","saved_over","eot_moved","bad_events",
+	"no_eot","partial_eot"
+};
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// log levels: each one includes everything below it
+#define LOG_SILENT 0
+#define LOG_SUMMARY 1	// startup and totals
+#define LOG_FILE 2	// one line per MIDI written (the default)
+#define LOG_TRACK 3	// chatter about each header and track
+
+// slots in the log ring, and the longest line one slot holds
+#define LOG_SLOTS 512
+#define LOG_LINE 1088
+
+// The level is checked before the arguments are evaluated, so a disabled
+//  message costs one compare and no formatting.
+#define log_msg(level, ...) do { if (log_level >= (level)) log_emit(__VA_ARGS__); } while (0)
+#define note(...) log_msg(LOG_TRACK,__VA_ARGS__)
+
+// Build with -DCARVER_PROFILE to time each stage and count what the carver
+//  runs into; the breakdown goes to stderr at exit.  Without it the macros
+//  below compile to nothing.
+#ifdef CARVER_PROFILE
+enum
+{
+	PROF_INDEX,		// signature scan (pass one)
+	PROF_CARVE,		// carve_at, everything below included
+	PROF_ORPHAN,		// scoring and counting an orphan's MTrks
+	PROF_EXTRACT,		// extract_mtrk
+	PROF_BACKTRACK,		// extract_mtrk looking back for an MThd
+	PROF_VALIDATE,		// smf_walk
+	PROF_RESYNC,		// smart_extract's recovery search
+	PROF_MERGE_WAIT,	// waiting on a worker's chunk
+	PROF_QUEUE_WAIT,	// waiting for room in the write queue
+	PROF_HASH,		// hashing output for the manifest and dedup
+	PROF_WRITE,		// write_midi
+	PROF_STAGES
+};
+
+enum
+{
+	CNT_TAGS,		// tags indexed
+	CNT_CARVES,		// carve_at calls, speculative ones included
+	CNT_ORPHANS_IGNORED,	// orphan MTrks scored below min_score
+	CNT_BACKTRACKS,		// tracks without an end-of-track where expected
+	CNT_RESYNCS,		// missing MTrks
+	CNT_RESYNC_BYTES,	// bytes skipped to regain sync
+	CNT_SPECULATIVE_DROPPED,	// worker carves the merge threw away
+	CNT_CATCHUP_CARVES,	// carves the merge redid serially
+	CNT_COUNTERS
+};
+
+static const char *prof_stage_names[] = {
+	"index","carve","orphan","extract","backtrack","validate","resync",
+	"merge wait","queue wait","hash","write"
+};
+
+static const char *prof_counter_names[] = {
+	"tags","carves","orphans ignored","backtracks","resyncs","resync bytes",
+	"speculative dropped","catch-up carves"
+};
+
+// Each thread adds into its own record, found through a thread-local
+//  pointer, so counting never contends.  Records are summed at exit, after
+//  every other thread has been joined.
+struct prof_thread
+{
+	unsigned long long ticks[PROF_STAGES], calls[PROF_STAGES];
+	unsigned long long count[CNT_COUNTERS];
+	struct prof_thread *next;
+};
+
+static __thread struct prof_thread *prof_self = NULL;
+static struct prof_thread *prof_all = NULL;
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long prof_t0;
+static struct timespec prof_wall0;
+
+// The cycle counter on x86, nanoseconds elsewhere.  Ticks are converted to
+//  time at exit against the wall clock over the whole run.
+static inline unsigned long long prof_now(void)
+{
+#ifdef SIGSCAN_X86
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static inline struct prof_thread *prof_get(void)
+{
+	if (prof_self == NULL)
+	{
+		prof_self = calloc(1,sizeof(struct prof_thread));
+		pthread_mutex_lock(&prof_lock);
+		prof_self->next = prof_all;
+		prof_all = prof_self;
+		pthread_mutex_unlock(&prof_lock);
+	}
+	return prof_self;
+}
+
+static inline void prof_add(int stage, unsigned long long ticks)
+{
+	struct prof_thread *t = prof_get();
+
+	t->ticks[stage] += ticks;
+	t->calls[stage]++;
+}
+
+static void prof_start(void)
+{
+	clock_gettime(CLOCK_MONOTONIC,&prof_wall0);
+	prof_t0 = prof_now();
+}
+
+// Sums every thread's record and prints the breakdown.  Stage times are
+//  added up across threads, so with a pool they can pass 100% of the wall
+//  clock, and stages nest: carve includes extract, which includes validate.
+static void prof_dump(void)
+{
+	struct prof_thread sum, *t;
+	struct timespec now;
+	double wall,tick;
+	int k,j;
+
+	clock_gettime(CLOCK_MONOTONIC,&now);
+	wall = (now.tv_sec - prof_wall0.tv_sec) * 1e9 + (now.tv_nsec - prof_wall0.tv_nsec);
+	tick = wall / (double)(prof_now() - prof_t0 ? prof_now() - prof_t0 : 1);
+
+	memset(&sum,0,sizeof(sum));
+	k = 0;
+	while ((t = prof_all) != NULL)
+	{
+		for (j = 0; j < PROF_STAGES; j++)
+		{
+			sum.ticks[j] += t->ticks[j];
+			sum.calls[j] += t->calls[j];
+		}
+		for (j = 0; j < CNT_COUNTERS; j++)
+			sum.count[j] += t->count[j];
+		prof_all = t->next;
+		free(t);
+		k++;
+	}
+	prof_self = NULL;
+
+	fprintf(stderr,"PROFILE: %.1f ms wall clock, %d threads counted\n",wall / 1e6,k);
+	fprintf(stderr,"PROFILE: %-22s %12s %12s %10s %8s\n","stage","calls","total ms","avg ns","% wall");
+	for (k = 0; k < PROF_STAGES; k++)
+		fprintf(stderr,"PROFILE: %-22s %12llu %12.1f %10.0f %7.1f%%\n",prof_stage_names[k],sum.calls[k],
+			sum.ticks[k] * tick / 1e6,sum.calls[k] ? sum.ticks[k] * tick / sum.calls[k] : 0.0,100.0 * sum.ticks[k] * tick / wall);
+	for (k = 0; k < CNT_COUNTERS; k++)
+		fprintf(stderr,"PROFILE: %-22s %12llu\n",prof_counter_names[k],sum.count[k]);
+}
+
+#define PROF_BEGIN(stage) unsigned long long prof_t_##stage = prof_now()
+#define PROF_END(stage) prof_add(stage,prof_now() - prof_t_##stage)
+#define PROF_COUNT(counter, n) (prof_get()->count[counter] += (n))
+#else
+#define PROF_BEGIN(stage) do { } while (0)
+#define PROF_END(stage) do { } while (0)
+#define PROF_COUNT(counter, n) do { } while (0)
+#endif
+
+// Largest MIDI we will reconstruct, in bytes.  No carve ever looks further
+//  than this past its starting offset, which is what lets stream mode keep
+//  only this much of the previous chunk around.
+static unsigned long window = DEFAULT_WINDOW * 1024UL * 1024UL;
+
+// A hole in a sparse image, from SEEK_HOLE/SEEK_DATA.  Holes read as
+//  zeros, so there's no tag in them: the scanner jumps over them, and in
+//  stream mode they're never read at all.
+struct hole
+{
+	long start, end;
+};
+
+// One file of an image split into segments (name.001, name.002, ...),
+//  which are carved as if they'd been joined end to end.  base is where
+//  the segment starts in the joined image.
+struct segment
+{
+	int fd;
+	long base, size;
+};
+
+// Bytes the scanner didn't have to look at.
+static atomic_long skipped_holes, skipped_zeros;
+
+static int log_level = LOG_FILE;
+
+// Work is split into pieces of this many bytes when there's a thread pool.
+static long chunk_size = DEFAULT_CHUNK * 1024L;
+
+static int min_score = DEFAULT_MIN_SCORE;
+
+// Read the image in pieces instead of mapping it, with a buffer this big;
+//  io_uring (falling back to pread) instead of read, and whether to bypass
+//  the page cache with O_DIRECT.
+static int stream = 0, use_uring = 0, direct_io = 0;
+static unsigned long max_memory = DEFAULT_MAX_MEMORY * 1024UL * 1024UL;
+
+// Set for more than one input image: each gets its own directory under
+//  mcut-out, and its manifest records say which image they came from.
+static int batch = 0;
+
+// One record per MIDI written, as JSON Lines or (for a .csv name) CSV.
+//  Written in image order by whoever writes the files; in a batch, each
+//  image writes its own part and the parts are joined in input order at
+//  the end.
+static const char *manifest_path = NULL;
+static int manifest_csv = 0;
+
+// Where a killed run can pick up from.  Every checkpoint_every seconds the
+//  carver queues a marker behind the carves it has emitted; when the writer
+//  reaches it, everything before the marker's offset is on disk, and the
+//  offset, counters, manifest length and duplicate table are saved.
+static int checkpoint_every = DEFAULT_CHECKPOINT;
+static int resume = 0;
+
+// Carve a gzip, zstd, xz or bzip2 image as what it decompresses to.
+static int decompress = 1;
+
+// Carve name.000 or name.001 and the segments numbered after it as one
+//  image.
+static int join_segments = 1;
+
+// What the progress thread reports.  Each counter has one writer, which
+//  stores to it at most once per carve, chunk or file, so the scan pays a
+//  plain store and the reader never takes a lock.
+static struct
+{
+	atomic_long tags;	// candidate tags found so far
+	atomic_long files;	// MIDIs written or found to be duplicates
+	long size;		// total size of the images, or -1 if unknown
+	int every;		// seconds between reports; 0 for none
+	const char *stats_path;	// rewrite this file instead of printing
+
+	int quit, running;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+} progress = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+// Log lines are formatted into a ring of slots and printed by the log
+//  thread, so carving threads never wait on the terminal.  A producer
+//  claims a ticket with one atomic add; slot seq says whose turn it is:
+//  seq == ticket means the slot is free for that ticket, ticket + 1 means
+//  it holds a line waiting to be printed.  Lines come out in ticket order.
+struct log_slot
+{
+	atomic_ulong seq;
+	int len;
+	char text[LOG_LINE];
+};
+
+static struct
+{
+	struct log_slot slot[LOG_SLOTS];
+	atomic_ulong head;	// next ticket to hand out
+	unsigned long tail;	// next ticket to print; log thread only
+	atomic_int quit;
+	int running;
+	pthread_t thread;
+} log_ring;
+
+// Every MIDI written so far from an image, keyed by XXH64 and length of
+//  its bytes, so a copy found again later can be pointed at instead of
+//  written twice.  Open addressing; a zero length marks an empty slot.
+struct seen
+{
+	unsigned long long hash;
+	unsigned long length;
+	long offset;		// of the copy that was written
+	const char *status;	// and its status, which together make its name
+};
+
+struct dedup
+{
+	struct seen *slot;
+	unsigned long n, cap;
+};
+
+// Write every MIDI, even one that's a copy of another.
+static int keep_duplicates = 0;
+
+// One input image and everything that belongs to carving it.  A batch
+//  carves several at once through the same pool and writer.
+struct image
+{
+	const char *path;
+	char out_dir[1000];
+	int fd, ret;
+	long size;		// -1 for a pipe, until it ends
+
+	// what the image is compressed with, and the child decompressing it
+	//  into fd; NULL if it isn't
+	const struct codec *codec;
+	pid_t decomp;
+
+	// the files of a split image, in order; fd is the first one's.  None
+	//  for an image in one piece.
+	struct segment *segs;
+	int nsegs;
+
+	long start;		// offset the scan began (or resumed) at
+
+	// the whole image, when it's mapped, so the scanner can issue readahead
+	unsigned char *mapped;
+
+	// holes, sorted; none if the filesystem can't tell
+	struct hole *holes;
+	long nholes;
+
+	FILE *manifest;
+	time_t checkpoint_next;
+
+	// MIDIs written, found to be duplicates, and writes that failed, and
+	//  the duplicate table.  Only ever touched by whoever is writing (the
+	//  writer thread, or with -q 0 the thread carving the image).
+	unsigned long files_written, files_duplicate, files_failed;
+	struct dedup dedup;
+
+	// for the progress thread: where the run began, and the image offsets
+	//  pass one and pass two have reached
+	atomic_long from, indexed, offset;
+};
+
+static struct image *images = NULL;
+static int nimages = 0;
+
+// All the bookkeeping for one carve (the mthd, its mtrks, anything
+//  synthesized) comes out of one arena, released in one go once the MIDI
+//  is written or thrown away.  Released arenas keep their first block and
+//  go on a free list, so steady-state carving does no malloc/free at all.
+struct arena_block
+{
+	struct arena_block *next;
+	size_t size, used;
+};
+
+struct arena
+{
+	struct arena_block *head;
+	unsigned long allocs, bytes, blocks;	// since last release
+	struct arena *next;
+};
 
-static char out_dir[1000];
+static struct arena *arena_free = NULL;
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// totals, updated on release under arena_lock
+static struct
+{
+	unsigned long arenas, carves, allocs, bytes, blocks, peak;
+} arena_stats;
 
 struct mthd
 {
 	unsigned short miditype,numtracks,timecode;
 	unsigned char is_damaged,is_generated;
+	unsigned short expected;	// tracks the header promised
+	unsigned short damage;		// DMG_* flags
+	unsigned long lost;		// bytes skipped to regain sync
+	unsigned long carve_ns;		// time spent carving, when there's a manifest
 	struct mtrk *track0;
+	struct arena *arena;	// owns this mthd and its tracks
 };
 
+// Track bytes are never copied: data points into the image (or stream
+//  buffer) and a repaired track gets its terminator from suffix.
 struct mtrk
 {
-	unsigned int size;
-	unsigned char extratrunc, *data;
+	unsigned int size;		// bytes after the track header: datalen + suffixlen
+	const unsigned char *data;
+	unsigned int datalen;
+	unsigned char suffix[4], suffixlen;
+	unsigned char extratrunc;	// we had to supply the end-of-track
+	unsigned char repaired;		// end-of-track wasn't where the header said
+	unsigned char score;		// confidence from smf_walk, 0-100
+	unsigned short damage;		// DMG_* flags for this track
+	unsigned long consumed;		// source bytes this track used up, header included
 	struct mtrk *next;
 };
 
-void write_mtrk(struct mtrk *track, FILE *fp)
+// What smf_walk() found in a track body.
+struct smf_check
+{
+	unsigned long end;	// just past the end-of-track, or the last whole event
+	unsigned long events;	// events that parsed cleanly
+	unsigned char has_eot;	// found FF 2F 00
+	unsigned char bad;	// stopped on something that isn't MIDI
+	unsigned char score;	// 0-100
+};
+
+// Sorted offsets of one kind of tag.
+struct taglist
+{
+	long *off;
+	long n, cap;
+};
+
+// A block of image data being carved, plus the offsets of every tag in it.
+//  Carving is two passes: index_block() records each MThd/MTrk once, then
+//  everything else looks tags up here instead of rescanning bytes.
+struct block
+{
+	unsigned char *data;
+	long avail;		// readable bytes at data
+	long base;		// image offset of data[0]
+	long indexed;		// tags starting before this are in the index
+	struct image *img;
+
+	struct taglist thd, trk;
+};
+
+// First index in a sorted tag list that is >= off.
+long index_lower(const struct taglist *list, long off)
+{
+	long lo=0,hi=list->n,mid;
+
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (list->off[mid] < off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// Offset of the first tag in list at or after off, or -1.
+long index_next(const struct taglist *list, long off)
+{
+	long k = index_lower(list,off);
+	return k < list->n ? list->off[k] : -1;
+}
+
+// Offset of the last tag in list before off, or -1.
+long index_prev(const struct taglist *list, long off)
+{
+	long k = index_lower(list,off);
+	return k > 0 ? list->off[k - 1] : -1;
+}
+
+// Is there a tag in list exactly at off?
+int index_has(const struct taglist *list, long off)
+{
+	long k = index_lower(list,off);
+	return k < list->n && list->off[k] == off;
+}
+
+// One MIDI carved out of a block, waiting to be written.
+struct carve
+{
+	long start, end;	// block positions; scanning resumes at end
+	long offset;		// image offset, used in the file name
+	struct image *img;
+	struct mthd *midi;
+	unsigned char checkpoint;	// no MIDI: save a checkpoint at offset
+};
+
+// A minimal thread pool.  Tasks are run in submission order by whichever
+//  worker is free; callers wait on individual tasks.
+struct task
+{
+	void (*run)(struct task *);
+	int done;
+	struct task *next;
+};
+
+struct pool
+{
+	pthread_t *threads;
+	int nthreads, quit;
+	pthread_mutex_t lock;
+	pthread_cond_t work, finished;
+	struct task *head, *tail;
+};
+
+static struct pool *pool = NULL;
+
+// Finished carves waiting for the writer thread, oldest at head.  The
+//  carver blocks in writer_push when it's full, so a slow output disk
+//  holds the scan back instead of letting carves pile up in memory.
+struct write_queue
+{
+	struct carve *items;
+	int cap, head, count, quit;
+	unsigned long pushed, written;	// carves so far, for writer_flush
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty, not_full, written_one;
+	pthread_t thread;
+};
+
+static struct write_queue *writer = NULL;
+
+// Formats a line into the ring.  Before the log thread starts (and after it
+//  stops) lines go straight to stdout.  If the ring is full this waits for
+//  the log thread to print the oldest line.
+void log_emit(const char *fmt, ...)
+{
+	va_list ap;
+	unsigned long ticket;
+	struct log_slot *s;
+	int len;
+
+	va_start(ap,fmt);
+	if (!log_ring.running)
+	{
+		vprintf(fmt,ap);
+		va_end(ap);
+		return;
+	}
+
+	ticket = atomic_fetch_add_explicit(&log_ring.head,1,memory_order_relaxed);
+	s = &log_ring.slot[ticket % LOG_SLOTS];
+	while (atomic_load_explicit(&s->seq,memory_order_acquire) != ticket)
+		sched_yield();
+
+	len = vsnprintf(s->text,LOG_LINE,fmt,ap);
+	s->len = (len < 0) ? 0 : (len < LOG_LINE ? len : LOG_LINE - 1);
+	atomic_store_explicit(&s->seq,ticket + 1,memory_order_release);
+	va_end(ap);
+}
+
+void *log_main(void *arg)
+{
+	struct log_slot *s;
+	struct timespec nap = { 0, 1000000 };
+
+	(void)arg;
+	while (1)
+	{
+		s = &log_ring.slot[log_ring.tail % LOG_SLOTS];
+		if (atomic_load_explicit(&s->seq,memory_order_acquire) == log_ring.tail + 1)
+		{
+			fwrite(s->text,1,s->len,stdout);
+			atomic_store_explicit(&s->seq,log_ring.tail + LOG_SLOTS,memory_order_release);
+			log_ring.tail++;
+			continue;
+		}
+
+		// caught up: flush, and stop once every ticket handed out is printed
+		fflush(stdout);
+		if (atomic_load(&log_ring.quit) && log_ring.tail == atomic_load(&log_ring.head))
+			break;
+		nanosleep(&nap,NULL);
+	}
+	return NULL;
+}
+
+void log_start(void)
+{
+	unsigned long k;
+
+	for (k = 0; k < LOG_SLOTS; k++)
+		atomic_init(&log_ring.slot[k].seq,k);
+	atomic_init(&log_ring.head,0);
+	atomic_init(&log_ring.quit,0);
+	log_ring.tail = 0;
+
+	fflush(stdout);
+	if (pthread_create(&log_ring.thread,NULL,log_main,NULL) == 0)
+		log_ring.running = 1;
+}
+
+// Prints whatever is left in the ring and stops the log thread.  Nothing
+//  may be logging from another thread at this point.
+void log_stop(void)
+{
+	if (!log_ring.running) return;
+
+	atomic_store(&log_ring.quit,1);
+	pthread_join(log_ring.thread,NULL);
+	log_ring.running = 0;
+}
+
+// Pass one has reached offset off in img, finding tags more candidates
+//  on the way.  Only called from the thread driving the image's scan.
+void progress_indexed(struct image *img, long off, long tags)
+{
+	atomic_store_explicit(&img->indexed,off,memory_order_relaxed);
+	atomic_fetch_add_explicit(&progress.tags,tags,memory_order_relaxed);
+}
+
+// Prints one report, or rewrites the stats file with it.  dt is the time
+//  since the last report; rates are over that interval, the ETA over the
+//  whole pass so far.
+void progress_report(double elapsed, double dt, int final)
+{
+	static const char *pass = NULL;
+	static double pass_time = 0;
+	static long last_pos = 0, last_tags = 0;
+	long start=0,indexed=0,offset=0,tags,files,pos,end,eta=-1;
+	const char *phase;
+	double rate,crate,pct=-1;
+	char tmp[1040];
+	FILE *f;
+	int k;
+
+	// a batch is reported as if its images were laid end to end
+	for (k = 0; k < nimages; k++)
+	{
+		start += atomic_load_explicit(&images[k].from,memory_order_relaxed);
+		indexed += atomic_load_explicit(&images[k].indexed,memory_order_relaxed);
+		offset += atomic_load_explicit(&images[k].offset,memory_order_relaxed);
+	}
+	tags = atomic_load_explicit(&progress.tags,memory_order_relaxed);
+	files = atomic_load_explicit(&progress.files,memory_order_relaxed);
+
+	// the passes take turns on each slice or buffer; until pass two has
+	//  started, pass one's progress is all there is to report
+	end = progress.size >= 0 ? progress.size : indexed;
+	if (offset <= start && indexed + 3 < end)
+	{
+		phase = "indexing";
+		pos = indexed;
+	} else {
+		phase = "carving";
+		pos = offset > start ? offset : start;
+	}
+
+	// both passes start over from the same offset
+	if (pass != phase)
+	{
+		pass = phase;
+		pass_time = elapsed - dt;
+		last_pos = start;
+	}
+
+	rate = dt > 0 ? (pos - last_pos) / dt : 0;
+	crate = dt > 0 ? (tags - last_tags) / dt : 0;
+	if (progress.size > 0)
+	{
+		pct = 100.0 * (pos - start) / (progress.size - start > 0 ? progress.size - start : 1);
+		if (pos > start && elapsed > pass_time)
+			eta = (progress.size - pos) / ((pos - start) / (elapsed - pass_time));
+	}
+	last_pos = pos;
+	last_tags = tags;
+
+	if (progress.stats_path == NULL)
+	{
+		fprintf(stderr,"PROGRESS: %s %ld",phase,pos);
+		if (progress.size >= 0)
+			fprintf(stderr," of %ld (%.1f%%)",progress.size,pct);
+		fprintf(stderr,", %.1f MB/s, %.0f candidates/s, %ld files",rate / (1024 * 1024),crate,files);
+		if (eta >= 0 && !final)
+			fprintf(stderr,", ETA %ld:%02ld:%02ld",eta / 3600,eta / 60 % 60,eta % 60);
+		fprintf(stderr,"%s\n",final ? ", done" : "");
+		return;
+	}
+
+	snprintf(tmp,sizeof(tmp),"%s.tmp",progress.stats_path);
+	f = fopen(tmp,"w");
+	if (f == NULL) return;
+	fprintf(f,"{\"phase\":\"%s\",\"offset\":%ld,\"size\":%ld,\"percent\":%.2f,\"mb_per_s\":%.2f,"
+		"\"candidates_per_s\":%.0f,\"candidates\":%ld,\"files\":%ld,\"elapsed_s\":%.1f,\"eta_s\":%ld,\"done\":%s}\n",
+		final ? "done" : phase,pos,progress.size,pct,rate / (1024 * 1024),crate,tags,files,elapsed,final ? 0 : eta,final ? "true" : "false");
+	if (fclose(f) == 0)
+		rename(tmp,progress.stats_path);
+}
+
+void *progress_main(void *arg)
+{
+	struct timespec t0,now,last,wake;
+	double elapsed,dt;
+	int quit;
+
+	(void)arg;
+	clock_gettime(CLOCK_MONOTONIC,&t0);
+	last = t0;
+
+	pthread_mutex_lock(&progress.lock);
+	do
+	{
+		clock_gettime(CLOCK_REALTIME,&wake);
+		wake.tv_sec += progress.every;
+		while (!progress.quit && pthread_cond_timedwait(&progress.wake,&progress.lock,&wake) == 0)
+			;
+		quit = progress.quit;
+		pthread_mutex_unlock(&progress.lock);
+
+		clock_gettime(CLOCK_MONOTONIC,&now);
+		elapsed = (now.tv_sec - t0.tv_sec) + (now.tv_nsec - t0.tv_nsec) / 1e9;
+		dt = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+		last = now;
+		progress_report(elapsed,dt,quit);
+
+		pthread_mutex_lock(&progress.lock);
+	} while (!quit);
+	pthread_mutex_unlock(&progress.lock);
+	return NULL;
+}
+
+// Starts reporting on the scan of images totalling size bytes (-1 if
+//  unknown).  Each image's offsets start at zero, until it's opened.
+void progress_start(long size)
+{
+	progress.size = size;
+	if (progress.every <= 0) return;
+	if (pthread_create(&progress.thread,NULL,progress_main,NULL) == 0)
+		progress.running = 1;
+}
+
+// Gives a last report and stops the thread.
+void progress_stop(void)
+{
+	if (!progress.running) return;
+
+	pthread_mutex_lock(&progress.lock);
+	progress.quit = 1;
+	pthread_cond_signal(&progress.wake);
+	pthread_mutex_unlock(&progress.lock);
+	pthread_join(progress.thread,NULL);
+	progress.running = 0;
+}
+
+// Gets an empty arena, reusing a released one if possible.
+struct arena *arena_get(void)
+{
+	struct arena *a;
+
+	pthread_mutex_lock(&arena_lock);
+	a = arena_free;
+	if (a != NULL)
+		arena_free = a->next;
+	else
+		arena_stats.arenas++;
+	pthread_mutex_unlock(&arena_lock);
+
+	if (a == NULL)
+	{
+		a = calloc(1,sizeof(struct arena));
+		if (a == NULL)
+		{
+			fprintf(stderr,"Out of memory allocating an arena!\n");
+			exit(-1);
+		}
+	}
+	return a;
+}
+
+void *arena_alloc(struct arena *a, size_t n)
+{
+	struct arena_block *b = a->head;
+	size_t size;
+	void *p;
+
+	n = (n + 15) & ~(size_t)15;
+	if (b == NULL || b->used + n > b->size)
+	{
+		size = n > ARENA_BLOCK ? n : ARENA_BLOCK;
+		b = malloc(sizeof(struct arena_block) + 16 + size);
+		if (b == NULL)
+		{
+			fprintf(stderr,"Out of memory growing an arena!\n");
+			exit(-1);
+		}
+		b->size = size;
+		b->used = 0;
+		b->next = a->head;
+		a->head = b;
+		a->blocks++;
+	}
+
+	// blocks are followed by 16 bytes of padding so data stays aligned
+	p = (unsigned char *)b + ((sizeof(struct arena_block) + 15) & ~(size_t)15) + b->used;
+	b->used += n;
+	a->allocs++;
+	a->bytes += n;
+	return p;
+}
+
+// Empties the arena and puts it back on the free list.  Everything
+//  allocated from it is gone, including the mthd that pointed to it.
+void arena_release(struct arena *a)
+{
+	struct arena_block *b;
+
+	if (a == NULL) return;
+
+	// keep the oldest block (the first one allocated), free the rest
+	while (a->head != NULL && a->head->next != NULL)
+	{
+		b = a->head;
+		a->head = b->next;
+		free(b);
+	}
+	if (a->head != NULL)
+		a->head->used = 0;
+
+	pthread_mutex_lock(&arena_lock);
+	arena_stats.carves++;
+	arena_stats.allocs += a->allocs;
+	arena_stats.bytes += a->bytes;
+	arena_stats.blocks += a->blocks;
+	if (a->bytes > arena_stats.peak) arena_stats.peak = a->bytes;
+	a->allocs = a->bytes = a->blocks = 0;
+	a->next = arena_free;
+	arena_free = a;
+	pthread_mutex_unlock(&arena_lock);
+}
+
+// Frees every arena on the free list.  Called at exit.
+void arena_cleanup(void)
+{
+	struct arena *a;
+
+	while ((a = arena_free) != NULL)
+	{
+		arena_free = a->next;
+		if (a->head != NULL)
+			free(a->head);
+		free(a);
+	}
+}
+
+// Throws away a MIDI once it's been written (or won't be).
+void free_midi(struct mthd *midi)
+{
+	if (midi == NULL) return;
+	arena_release(midi->arena);
+}
+
+// writev that keeps going after a short write, and splits lists longer
+//  than the system allows into several calls.
+int writev_all(int fd, struct iovec *iov, int n)
+{
+	ssize_t done;
+
+	while (n > 0)
+	{
+		done = writev(fd,iov,n < IOV_MAX ? n : IOV_MAX);
+		if (done < 0) return -1;
+		while (n > 0 && (size_t)done >= iov->iov_len)
+		{
+			done -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n > 0)
+		{
+			iov->iov_base = (char *)iov->iov_base + done;
+			iov->iov_len -= done;
+		}
+	}
+	return 0;
+}
+
+// Lays out the whole output file as an iovec list: the MThd, then for each
+//  track its 8-byte header, its bytes in the image and any repair suffix.
+//  Headers and the list itself live in the MIDI's arena.  Returns the list
+//  and stores its length in n.
+struct iovec *midi_iov(struct mthd *midi, int *n)
+{
+	struct mtrk *track;
+	struct iovec *iov;
+	unsigned char *hdr;
+	int ntracks=0,k=0;
+
+	for (track = midi->track0; track != NULL; track = track->next)
+		ntracks++;
+
+	iov = arena_alloc(midi->arena,(1 + 3 * ntracks) * sizeof(struct iovec));
+	hdr = arena_alloc(midi->arena,14 + 8 * ntracks);
+
+	memcpy(hdr,"MThd\0\0\0\x06",8);
+	hdr[8] = ((midi->miditype) / 256);
+	hdr[9] = ((midi->miditype) % 256);
+	hdr[10] = ((midi->numtracks) / 256);
+	hdr[11] = ((midi->numtracks) % 256);
+	hdr[12] = ((midi->timecode) / 256);
+	hdr[13] = ((midi->timecode) % 256);
+	iov[k].iov_base = hdr;
+	iov[k++].iov_len = 14;
+	hdr += 14;
+
+	for (track = midi->track0; track != NULL; track = track->next)
+	{
+		// convert size to device-independent buffer
+		memcpy(hdr,"MTrk",4);
+		hdr[4] = (track->size >> 24) & 0xFF;
+		hdr[5] = (track->size >> 16) & 0xFF;
+		hdr[6] = (track->size >> 8) & 0xFF;
+		hdr[7] = track->size & 0xFF;
+		iov[k].iov_base = hdr;
+		iov[k++].iov_len = 8;
+		hdr += 8;
+
+		// track bytes go to disk straight from the image
+		iov[k].iov_base = (void *)track->data;
+		iov[k++].iov_len = track->datalen;
+		if (track->suffixlen)
+		{
+			iov[k].iov_base = track->suffix;
+			iov[k++].iov_len = track->suffixlen;
+		}
+	}
+
+	*n = k;
+	return iov;
+}
+
+// Writes a MIDI laid out by midi_iov in a single pass.  The list is
+//  used up in the process.
+int write_midi(struct iovec *iov, int n, const char *filename)
+{
+	int fd,ret;
+
+	fd = open(filename,O_WRONLY | O_CREAT | O_TRUNC,0644);
+	if (fd < 0)
+	{
+		log_msg(LOG_SUMMARY," ERROR: could not open %s for writing!!\n",filename);
+		return 1;
+	}
+
+	ret = writev_all(fd,iov,n);
+
+	close(fd);
+
+	if (ret != 0)
+	{
+		log_msg(LOG_SUMMARY," ERROR: could not write %s!!\n",filename);
+		return 1;
+	}
+
+	log_msg(LOG_FILE," Success!  Wrote %s to disk.\n",filename);
+
+	return 0;
+}
+
+// Extracts an MThd from a block, allocating it from arena a.
+//  avail is the number of readable bytes at buffer.
+struct mthd *extract_mthd(unsigned char *buffer, unsigned long avail, struct arena *a)
+{
+	struct mthd *newmidi = NULL;
+	unsigned int ipointer;
+
+	if (avail < 14)
+	{
+		note(" Header is cut off by the end of the data, skipping it.\n");
+		return NULL;
+	}
+
+// looks like a winner?
+	if (strncmp((char *)buffer,"MThd",4) == 0)
+	{
+		newmidi = arena_alloc(a,sizeof(struct mthd));
+		newmidi->track0=NULL;
+		newmidi->arena=a;
+
+		newmidi->is_damaged=0;
+		newmidi->is_generated=0;
+		newmidi->damage=0;
+		newmidi->lost=0;
+		newmidi->carve_ns=0;
+
+// Looks like a MIDI file, let's check for consistency
+// figure the buffer size - this is stupid of course as it should always be 6
+//  but oh well.
+		ipointer = (buffer[4] * 16777216) +
+			(buffer[5] * 65536) +
+			(buffer[6] * 256) +
+			buffer[7];
+		if (ipointer == 6) note(" Header indicates 6 bytes length, that's good.\n"); else {
+			note(" Header size says %d bytes - bad news, it should be 6.  Continuing anyway.\n",ipointer);
+			newmidi->damage |= DMG_HEADER_SIZE;
+		}
+
+// Get the MIDI Type
+		newmidi->miditype = buffer[8] * 256 + buffer[9];
+		if (newmidi->miditype <= 2)
+			note(" MIDI file says it is type %hd\n",newmidi->miditype);
+		else {
+			note(" MIDI file is type %hd (should be 0-2).  Continuing anyway.\n",newmidi->miditype);
+			newmidi->damage |= DMG_BAD_TYPE;
+		}
+
+// Get the number of tracks
+		newmidi->numtracks = buffer[10] * 256 + buffer[11];
+		note(" MIDI says there should be %hd tracks here.\n",newmidi->numtracks);
+		newmidi->expected = newmidi->numtracks;
+
+		if (newmidi->miditype == 0 && newmidi->numtracks != 1)
+		{
+			note(" NOTE that type 0 should have only 1 track...?  Altering type to Type 1.\n");
+			newmidi->miditype=1;
+			newmidi->damage |= DMG_TYPE_FIXED;
+		}
+
+// Get the timecode.  This can't really be verified.
+		newmidi->timecode = buffer[12] * 256 + buffer[13];
+		note(" MIDI timecode:  %hd\n",newmidi->timecode);
+	}
+	return newmidi;
+}
+
+// Reads a variable-length quantity (at most 4 bytes) at *i.
+//  Returns 0 if it runs past len or is too long.
+int smf_vlq(const unsigned char *p, unsigned long len, unsigned long *i, unsigned long *value)
+{
+	int k;
+
+	*value = 0;
+	for (k = 0; k < 4 && *i < len; k++)
+	{
+		*value = (*value << 7) | (p[*i] & 0x7F);
+		if ((p[(*i)++] & 0x80) == 0) return 1;
+	}
+	return 0;
+}
+
+// Walks a track body event by event - delta time, then a channel message
+//  (with running status), sysex or meta event - in one linear pass.  Stops
+//  at the end-of-track meta event, at the first byte that can't be MIDI, or
+//  at len.  Real tracks end in FF 2F 00 exactly at len; random bytes that
+//  happen to follow an "MTrk" rarely get past a few events.
+void smf_walk(const unsigned char *p, unsigned long len, struct smf_check *chk)
+{
+	unsigned long i=0,n;
+	unsigned char status=0,b,type;
+	int k,ndata;
+	PROF_BEGIN(PROF_VALIDATE);
+
+	memset(chk,0,sizeof(*chk));
+
+	while (i < len)
+	{
+		if (!smf_vlq(p,len,&i,&n) || i >= len) break;
+
+		b = p[i];
+		if (b == 0xFF)
+		{
+			// meta event: type, length, data.  Cancels running status.
+			if (i + 1 >= len || p[i + 1] & 0x80)
+			{
+				chk->bad = (i + 1 < len);
+				break;
+			}
+			type = p[i + 1];
+			i += 2;
+			if (!smf_vlq(p,len,&i,&n) || n > len - i) break;
+			i += n;
+			status = 0;
+			chk->events++;
+			chk->end = i;
+			if (type == 0x2F)
+			{
+				chk->has_eot = 1;
+				break;
+			}
+			continue;
+		} else if (b == 0xF0 || b == 0xF7)
+		{
+			// sysex: length, data
+			i++;
+			if (!smf_vlq(p,len,&i,&n) || n > len - i) break;
+			i += n;
+			status = 0;
+			chk->events++;
+			chk->end = i;
+			continue;
+		} else if (b >= 0xF0)
+		{
+			// system common/realtime bytes don't belong in a file
+			chk->bad = 1;
+			break;
+		} else if (b & 0x80)
+		{
+			status = b;
+			i++;
+		} else if (status == 0)
+		{
+			// data byte with no running status to apply it to
+			chk->bad = 1;
+			break;
+		}
+
+		ndata = ((status & 0xF0) == 0xC0 || (status & 0xF0) == 0xD0) ? 1 : 2;
+		for (k = 0; k < ndata && i < len; k++, i++)
+			if (p[i] & 0x80) break;
+		if (k < ndata)
+		{
+			chk->bad = (i < len);
+			break;
+		}
+		chk->events++;
+		chk->end = i;
+	}
+
+	if (chk->has_eot)
+		chk->score = (chk->end == len) ? 100 : 80;
+	else
+		chk->score = chk->events >= 15 ? 60 : chk->events * 4;
+	PROF_END(PROF_VALIDATE);
+}
+
+// Extracts the MTrk (MIDI Track) at position i of a block.
+//  avail is the number of readable bytes at i; nothing past it is touched.
+//  Returns: a new mtrk struct from arena a, describing a proper, repaired,
+//   mtrk.  Its data points into the block, which must outlive it.
+struct mtrk *extract_mtrk(struct block *blk, long i, unsigned long avail, struct arena *a)
+{
+	struct mtrk* newtrack = NULL;
+	unsigned char *buffer = &blk->data[i];
+	unsigned int limit;
+	long h,j;
+	struct smf_check chk;
+
+// This is the "end of track" command
+	unsigned char end_of_track[]={0x00,0xFF,0x2F,0x00};
+	PROF_BEGIN(PROF_EXTRACT);
+
+	if (avail < 8 || strncmp((char *)buffer,"MTrk",4) != 0)
+	{
+		note(" Expected MTrk for track, but couldn't find it!\n");
+		return NULL;
+	} else {
+//		note(" Found MTrk tag for MIDI track\n");
+
+		newtrack = arena_alloc(a,sizeof(struct mtrk));
+		newtrack->next = NULL;
+		newtrack->data = &buffer[8];
+		newtrack->suffixlen = 0;
+		newtrack->repaired = 0;
+		newtrack->damage = 0;
+
+		newtrack->size = ((unsigned int)buffer[4] * 16777216) +
+			((unsigned int)buffer[5] * 65536) +
+			((unsigned int)buffer[6] * 256) +
+			(unsigned int)buffer[7];
+	
+		note(" MTrk is %d bytes long\n",newtrack->size);
+
+		// A size that runs off the end of the data (or is just garbage)
+		//  is treated like a missing end-of-track: cut the track where
+		//  the data ends and let the repair code below terminate it.
+		if (newtrack->size > avail - 0x08)
+		{
+			note("  Track runs past the end of the data (%lu bytes left), clamping it.\n",avail - 0x08);
+			newtrack->size = avail - 0x08;
+			newtrack->damage |= DMG_CLAMPED;
+		}
+
+		newtrack->consumed = newtrack->size + 0x08;
+
+		// ipointer should now point to
+		//  an "end of track" marker
+		if (newtrack->size < 0x04 || memcmp(&buffer[newtrack->size+0x04],end_of_track,4) != 0) {
+			if (newtrack->size < 0x03 || memcmp(&buffer[newtrack->size+0x05],&end_of_track[1],3) != 0) {
+				note("  Expected end-of-track but couldn't find it!\n");
+				if (newtrack->size >= 0x04)
+					note("  Instead I got: 0x%02x 0x%02x 0x%02x 0x%02x\n",buffer[newtrack->size+0x04],buffer[newtrack->size+0x04+1],buffer[newtrack->size+0x04+2],buffer[newtrack->size+0x04+3]);
+				note("  Sometimes this indicates the song has been overwritten.  I'll try to backtrack.\n");
+				limit = newtrack->size;
+				newtrack->repaired = 1;
+				PROF_COUNT(CNT_BACKTRACKS,1);
+
+				// Walk the events to find where the track really ends.  They
+				//  can't run on into another MIDI: data bytes under running
+				//  status would take an MThd and what follows it for notes.
+				h = index_next(&blk->thd,i + 8);
+				if (h >= 0 && h - i - 8 < (long)limit)
+					limit = h - i - 8;
+				smf_walk(&buffer[8],limit,&chk);
+				newtrack->score = chk.score;
+				if (chk.has_eot)
+				{
+					// the size field was wrong, not the track: whatever it
+					//  claimed past here belongs to something else
+					note("  Found the real end-of-track %lu bytes in.\n",chk.end);
+					newtrack->datalen = chk.end;
+					newtrack->size = chk.end;
+					newtrack->extratrunc = 0;
+					newtrack->consumed = chk.end + 8;
+					newtrack->damage |= DMG_EOT_MOVED;
+				} else {
+					// resume at the first tag after the last good event, so
+					//  that a bogus size hides nothing beyond it
+					PROF_BEGIN(PROF_BACKTRACK);
+					h = index_next(&blk->trk,i + 8 + chk.end);
+					j = index_next(&blk->thd,i + 8 + chk.end);
+					if (j >= 0 && (h < 0 || j < h)) h = j;
+					PROF_END(PROF_BACKTRACK);
+					newtrack->consumed = h >= 0 && h - i < (long)newtrack->consumed ? h - i : limit + 8;
+					if (h >= 0 && h == j && h - i == (long)newtrack->consumed)
+					{
+						note("  Yes, looks like song was saved over.  Terminating and splitting here (%u -> %ld).\n",newtrack->size,h - i);
+						newtrack->damage |= DMG_SAVED_OVER;
+					} else
+						note("  Nope, file was simply damaged.\n");
+					if (chk.bad)
+					{
+						note("  Events stop making sense %lu bytes in; terminating after the last good one.\n",chk.end);
+						newtrack->datalen = chk.end;
+						newtrack->damage |= DMG_BAD_EVENTS;
+					} else {
+						note("  I'll just try to append a terminator and hope for the best.\n");
+						newtrack->datalen = newtrack->consumed - 8;
+					}
+					memcpy(newtrack->suffix,end_of_track,4);
+					newtrack->suffixlen = 4;
+					newtrack->size = newtrack->datalen + 0x04;
+					newtrack->extratrunc = 1;
+					newtrack->damage |= DMG_NO_EOT;
+				}
+			} else {
+				// FF 2F 00 after a nonzero delta time is a proper end, as long
+				//  as the events before it lead there
+				newtrack->datalen = newtrack->size;
+				newtrack->extratrunc = 0;
+				smf_walk(&buffer[8],newtrack->size,&chk);
+				newtrack->score = chk.score;
+				if (chk.has_eot && chk.end == newtrack->size)
+					note("  Got end-of-track after a delta time, seems consistent enough...\n");
+				else
+				{
+					note("  Got 0xff2f00 at the end, but the events don't lead there\n");
+					newtrack->damage |= DMG_PARTIAL_EOT;
+				}
+			}
+		} else {
+			note("  Got complete end-of-track, seems consistent enough...\n");
+			newtrack->datalen = newtrack->size;
+			newtrack->extratrunc = 0;
+			smf_walk(&buffer[8],newtrack->size,&chk);
+			newtrack->score = chk.score;
+		}
+	}
+	PROF_END(PROF_EXTRACT);
+	return newtrack;
+}
+
+// Map the whole image read-only.  Pages are shared with the page cache and
+//  faulted in as the scan reaches them, so nothing is copied up front and
+//  images larger than RAM work.  Returns NULL if the file can't be mapped
+//  (empty file, pipe, etc.), in which case the caller falls back to fread.
+unsigned char *map_image(int fd, long filesize)
+{
+	void *map;
+
+	if (filesize <= 0) return NULL;
+
+	map = mmap(NULL,filesize,PROT_READ,MAP_PRIVATE,fd,0);
+	if (map == MAP_FAILED) return NULL;
+
+	madvise(map,filesize,MADV_SEQUENTIAL);
+	return map;
+}
+
+// Asks for the next stretch of the mapping to be read ahead of the scanner.
+//  Only called once per PREFETCH_AHEAD bytes, so the hint stays cheap.
+void prefetch_image(unsigned char *buffer, long filesize, long i)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	long start = (i / page) * page;
+	long len = PREFETCH_AHEAD;
+
+	if (start >= filesize) return;
+	if (start + len > filesize) len = filesize - start;
+	madvise(&buffer[start],len,MADV_WILLNEED);
+}
+
+// Adds the holes in the size bytes of fd to img's list, as if fd began
+//  at image offset base.
+void map_holes_fd(struct image *img, int fd, long base, long size, long *cap)
+{
+	long data=0,hole;
+
+#ifdef SEEK_HOLE
+	while (data < size)
+	{
+		hole = lseek(fd,data,SEEK_HOLE);
+		if (hole < 0 || hole >= size) break;
+		data = lseek(fd,hole,SEEK_DATA);
+		if (data < 0 || data > size) data = size;	// ENXIO: a hole to the end
+
+		if (img->nholes == *cap)
+		{
+			*cap = *cap ? *cap * 2 : 64;
+			img->holes = realloc(img->holes,*cap * sizeof(struct hole));
+			if (img->holes == NULL)
+			{
+				fprintf(stderr,"Out of memory listing holes!\n");
+				exit(-1);
+			}
+		}
+		img->holes[img->nholes].start = base + hole;
+		img->holes[img->nholes].end = base + data;
+		img->nholes++;
+	}
+	lseek(fd,0,SEEK_SET);
+#else
+	(void)img; (void)fd; (void)base; (void)size; (void)cap;
+#endif
+}
+
+// If path ends in a segment number, returns it and sets *stem to the
+//  length of what comes before it and *width to its digits.  Only split
+//  tools' naming counts: three or more zero-padded digits after the last
+//  '.', so that disk.1 and disk.2 stay two images.  -1 otherwise.
+long segment_number(const char *path, int *stem, int *width)
+{
+	const char *dot = strrchr(path,'.'),*p;
+
+	if (dot == NULL || strchr(dot,'/') != NULL) return -1;
+	for (p = dot + 1; *p != '\0'; p++)
+		if (*p < '0' || *p > '9') return -1;
+	*stem = dot + 1 - path;
+	*width = p - dot - 1;
+	if (*width < 3 || *width > 9) return -1;
+	return strtol(dot + 1,NULL,10);
+}
+
+// Names segment n of the set path belongs to.
+void segment_path(char *out, size_t len, const char *path, int stem, int width, long n)
+{
+	snprintf(out,len,"%.*s%0*ld",stem,path,width,n);
+}
+
+// Is path the first segment of a split image: numbered 000 or 001, with
+//  the next number beside it?  Never with --no-split.
+int segment_first(const char *path)
+{
+	char next[1040];
+	int stem,width;
+	long n;
+
+	if (!join_segments) return 0;
+	n = segment_number(path,&stem,&width);
+	if (n != 0 && n != 1) return 0;
+	segment_path(next,sizeof(next),path,stem,width,n + 1);
+	return access(next,F_OK) == 0;
+}
+
+// Opens every segment of the split image img->path names the first of,
+//  up to the first number that's missing.  Sets img->size to their total
+//  and img->fd to the first.  0 on success.
+int open_segments(struct image *img)
+{
+	char name[1040];
+	struct stat st;
+	int stem,width,cap=0;
+	long n = segment_number(img->path,&stem,&width);
+
+	img->size = 0;
+	for (;; n++)
+	{
+		segment_path(name,sizeof(name),img->path,stem,width,n);
+		if (img->nsegs > 0 && access(name,F_OK) != 0) break;
+
+		if (img->nsegs == cap)
+		{
+			cap = cap ? cap * 2 : 16;
+			img->segs = realloc(img->segs,cap * sizeof(struct segment));
+			if (img->segs == NULL)
+			{
+				fprintf(stderr,"Out of memory opening segments!\n");
+				exit(-1);
+			}
+		}
+		img->segs[img->nsegs].fd = open(name,O_RDONLY);
+		if (img->segs[img->nsegs].fd < 0 || fstat(img->segs[img->nsegs].fd,&st) != 0 || !S_ISREG(st.st_mode))
+		{
+			fprintf(stderr,"Could not open segment %s!\n",name);
+			if (img->segs[img->nsegs].fd >= 0) close(img->segs[img->nsegs].fd);
+			return -1;
+		}
+		img->segs[img->nsegs].base = img->size;
+		img->segs[img->nsegs].size = st.st_size;
+		img->size += st.st_size;
+		img->nsegs++;
+	}
+	img->fd = img->segs[0].fd;
+	return 0;
+}
+
+// Maps a split image's segments one after another into one stretch of
+//  address space, so the scan sees a single image.  Only possible when
+//  every segment but the last is a whole number of pages; NULL otherwise,
+//  and the caller streams it instead.
+unsigned char *map_segments(struct image *img)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	unsigned char *base;
+	int k;
+
+	if (img->size <= 0) return NULL;
+	for (k = 0; k < img->nsegs - 1; k++)
+		if (img->segs[k].size % page != 0) return NULL;
+
+	// reserve the whole range first, then lay each segment over its part
+	base = mmap(NULL,img->size,PROT_NONE,MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,-1,0);
+	if (base == MAP_FAILED) return NULL;
+	for (k = 0; k < img->nsegs; k++)
+	{
+		if (img->segs[k].size == 0) continue;
+		if (mmap(&base[img->segs[k].base],img->segs[k].size,PROT_READ,MAP_PRIVATE | MAP_FIXED,img->segs[k].fd,0) == MAP_FAILED)
+		{
+			munmap(base,img->size);
+			return NULL;
+		}
+	}
+
+	madvise(base,img->size,MADV_SEQUENTIAL);
+	return base;
+}
+
+// The segment holding image offset off, or NULL past the end.
+struct segment *segment_at(struct image *img, long off)
+{
+	int lo=0,hi=img->nsegs,mid;
+
+	// the last segment starting at or before off; empty ones lose out to
+	//  the segment that starts where they do
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (img->segs[mid].base <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0 || off >= img->segs[lo - 1].base + img->segs[lo - 1].size) return NULL;
+	return &img->segs[lo - 1];
+}
+
+// Moves the input on to image offset off.  A split image is read at
+//  offsets, so it has nothing to move.  0 on success.
+int image_seek(struct image *img, long off)
+{
+	if (img->nsegs > 0) return 0;
+	return lseek(img->fd,off,SEEK_SET) == off ? 0 : -1;
+}
+
+// Reads up to len bytes at image offset off, which for an image in one
+//  piece is where its input already is.  A split image's reads stop at the
+//  end of a segment.
+ssize_t image_read(struct image *img, unsigned char *buf, long len, long off)
+{
+	struct segment *seg;
+
+	if (img->nsegs == 0)
+		return read(img->fd,buf,len);
+
+	seg = segment_at(img,off);
+	if (seg == NULL) return 0;
+	if (len > seg->base + seg->size - off) len = seg->base + seg->size - off;
+	return pread(seg->fd,buf,len,off - seg->base);
+}
+
+// Lists the holes in an image.  Leaves the list empty where the
+//  filesystem can't tell (every byte is then data).  A hole that crosses
+//  from one segment into the next is listed as two.
+void map_holes(struct image *img)
+{
+	long cap=0;
+	int k;
+
+	if (img->nsegs == 0)
+		map_holes_fd(img,img->fd,0,img->size,&cap);
+	for (k = 0; k < img->nsegs; k++)
+		map_holes_fd(img,img->segs[k].fd,img->segs[k].base,img->segs[k].size,&cap);
+}
+
+// The first hole in img that ends after offset off, or NULL.  off is
+//  inside it if its start is <= off.
+struct hole *hole_after(struct image *img, long off)
+{
+	long lo=0,hi=img->nholes,mid;
+
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (img->holes[mid].end <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < img->nholes ? &img->holes[lo] : NULL;
+}
+
+// Makes room for n more tags.
+void index_reserve(struct taglist *list, long n)
+{
+	if (list->n + n <= list->cap) return;
+
+	while (list->n + n > list->cap)
+		list->cap = list->cap ? list->cap * 2 : 1024;
+	list->off = realloc(list->off,list->cap * sizeof(long));
+	if (list->off == NULL)
+	{
+		fprintf(stderr,"Out of memory growing the signature index!\n");
+		exit(-1);
+	}
+}
+
+void index_push(struct taglist *list, long off)
+{
+	index_reserve(list,1);
+	list->off[list->n++] = off;
+}
+
+// Records every tag in blk that starts in [i, to).  Holes and runs of
+//  zeros are stepped over rather than searched.
+void index_range(struct block *blk, long i, long to, struct taglist *thd, struct taglist *trk)
+{
+	const unsigned char *data = blk->data;
+	struct image *img = blk->img;
+	long base = blk->base,end = blk->avail,stop,z,next_prefetch=i,hole_bytes=0,zero_bytes=0;
+	struct hole *h;
+	int kind,at_hole;
+	PROF_BEGIN(PROF_INDEX);
+
+	if (end > to + 3) end = to + 3;
+	while (i + 4 <= end)
+	{
+		stop = end;
+		if (stop > i + SCAN_STEP) stop = i + SCAN_STEP;
+
+		// a tag can't overlap a hole, so a step ends where one starts
+		at_hole = 0;
+		if (img->nholes > 0 && (h = hole_after(img,base + i)) != NULL && h->start - base < stop)
+		{
+			if (h->start - base <= i)
+			{
+				z = h->end - base < to ? h->end - base : to;
+				hole_bytes += z - i;
+				i = z;
+				continue;
+			}
+			stop = h->start - base;
+			at_hole = 1;
+		}
+
+		if (img->mapped != NULL && i >= next_prefetch)
+		{
+			prefetch_image(img->mapped,img->size,base + i);
+			next_prefetch = i + PREFETCH_AHEAD / 2;
+		}
+
+		z = sig_zeros(data,i,stop);
+		zero_bytes += z - i;
+		i = sig_next(data,z,stop,&kind);
+		if (i < 0)
+		{
+			i = at_hole ? stop : stop - 3;
+			continue;
+		}
+		if (kind == SIG_MTHD)
+			index_push(thd,i);
+		else
+			index_push(trk,i);
+		PROF_COUNT(CNT_TAGS,1);
+		i++;
+	}
+	atomic_fetch_add_explicit(&skipped_holes,hole_bytes,memory_order_relaxed);
+	atomic_fetch_add_explicit(&skipped_zeros,zero_bytes,memory_order_relaxed);
+	PROF_END(PROF_INDEX);
+}
+
+// Appends src to dst and empties src.
+void index_append(struct taglist *dst, struct taglist *src)
+{
+	if (src->n > 0)
+	{
+		index_reserve(dst,src->n);
+		memcpy(&dst->off[dst->n],src->off,src->n * sizeof(long));
+		dst->n += src->n;
+	}
+	free(src->off);
+	memset(src,0,sizeof(*src));
+}
+
+void index_free(struct taglist *list)
+{
+	free(list->off);
+	memset(list,0,sizeof(*list));
+}
+
+// Drops tags before off and rebases the rest, after the stream buffer has
+//  been shifted down by off bytes.
+void index_shift(struct taglist *list, long off)
+{
+	long k = index_lower(list,off),m;
+
+	for (m = k; m < list->n; m++)
+		list->off[m - k] = list->off[m] - off;
+	list->n -= k;
+}
+
+// Rebases a block's index when its data now starts off bytes further in.
+//  A carve can end past what's been indexed (a tag's last bytes sit
+//  within 3 of the end), and then indexing starts over at the new start.
+void block_shift(struct block *blk, long off)
+{
+	index_shift(&blk->thd,off);
+	index_shift(&blk->trk,off);
+	blk->indexed = blk->indexed > off ? blk->indexed - off : 0;
+}
+
+// Function for "smart extract" of series of MTrks.
+//  Given a mthd struct, fills the linked list with the tracks found from
+//  start onward, reading nothing at or past stop.  Returns bytes consumed.
+long smart_extract(struct mthd* midi, struct block *blk, long start, long stop, unsigned long max_distance)
+{
+	long int i=start,j,h;
+	unsigned short int curtrack=0;
+	unsigned char in_mthd = 1,lost_sync=0;
+
+	struct mtrk *newtrack, *track=NULL;
+
+	while (in_mthd)
+	{
+		if (i + 8 > stop)
+		{
+			note(" Ran out of data before track %hd (expected %hu).  Truncating MIDI file here.\n",curtrack,midi->numtracks);
+			midi->numtracks = curtrack;
+			midi->is_damaged = 1;
+			midi->damage |= DMG_TRUNCATED;
+			in_mthd = 0;
+		} else if (index_has(&blk->thd,i))
+		{
+			note(" Collision with another MIDI, we came up short in tracks (expected %hu, got %hu).\n",midi->numtracks,curtrack);
+			midi->numtracks = curtrack;
+			midi->is_damaged = 1;
+			midi->damage |= DMG_COLLISION;
+			in_mthd = 0;
+		} else if (!index_has(&blk->trk,i))
+		{
+			note(" Missing MTrk tag for track %hd, this indicates a damaged MIDI file.\n  Starting recovery search.\n",curtrack);
+			midi->is_damaged = 1;
+			midi->damage |= DMG_LOST_SYNC;
+
+			lost_sync = 1;
+			PROF_COUNT(CNT_RESYNCS,1);
+			PROF_BEGIN(PROF_RESYNC);
+			// Recovery search.  Look from here to end of file, max distance, and don't look into other MIDIs : )
+			j = index_next(&blk->trk,i+1);
+			h = index_next(&blk->thd,i+1);
+			if (j >= 0 && (h < 0 || j < h) && j+4 <= stop && (unsigned long)(j-i) < max_distance)
+			{
+				note(" Found an MTrk tag at point %ld.  %ld bytes were lost, but at least we regained sync.\n",blk->base+j,j-i);
+				midi->lost += j-i;
+				PROF_COUNT(CNT_RESYNC_BYTES,j-i);
+				i = j;
+				lost_sync=0;
+			}
+			PROF_END(PROF_RESYNC);
+			if (lost_sync)
+			{
+				note(" Recovery search exceeded EOF or max_distance, or entered another MIDI header.  Truncating MIDI file here.\n");
+				midi->numtracks = curtrack;
+				midi->damage |= DMG_NO_RESYNC;
+				in_mthd = 0;
+			}
+		} else {
+			note(" Found MTrk for track %hd\n",curtrack);
+			newtrack = extract_mtrk(blk,i,stop-i,midi->arena);
+
+			// an orphan's later tracks must look as much like MIDI as its
+			//  first, or it strings together every stray tag that follows
+			if (midi->is_generated && curtrack > 0 && min_score > 0 && newtrack->score < min_score)
+			{
+				note(" Track %hd doesn't look like MIDI data.  Ending the orphan here.\n",curtrack);
+				midi->numtracks = curtrack;
+				midi->damage |= DMG_TRUNCATED;
+				break;
+			}
+
+			i+=newtrack->consumed;
+			if (newtrack->repaired) midi->is_damaged = 1;
+			midi->damage |= newtrack->damage;
+			if (midi->track0 == NULL)
+			{
+				midi->track0 = newtrack;
+			} else {
+				track->next=newtrack;
+			}
+			track=newtrack;
+
+			curtrack ++;
+			if (curtrack >= midi->numtracks)
+			{
+				in_mthd = 0;
+			}
+		}
+	}
+
+	return i - start;
+}
+
+void *pool_worker(void *arg)
+{
+	struct pool *p = arg;
+	struct task *t;
+
+	pthread_mutex_lock(&p->lock);
+	while (1)
+	{
+		while (p->head == NULL && !p->quit)
+			pthread_cond_wait(&p->work,&p->lock);
+		if (p->head == NULL) break;
+
+		t = p->head;
+		p->head = t->next;
+		if (p->head == NULL) p->tail = NULL;
+
+		pthread_mutex_unlock(&p->lock);
+		t->run(t);
+		pthread_mutex_lock(&p->lock);
+
+		t->done = 1;
+		pthread_cond_broadcast(&p->finished);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+struct pool *pool_create(int nthreads)
+{
+	struct pool *p = calloc(1,sizeof(struct pool));
+	int k;
+
+	if (p == NULL || (p->threads = calloc(nthreads,sizeof(pthread_t))) == NULL)
+	{
+		fprintf(stderr,"Out of memory starting the thread pool!\n");
+		exit(-1);
+	}
+	pthread_mutex_init(&p->lock,NULL);
+	pthread_cond_init(&p->work,NULL);
+	pthread_cond_init(&p->finished,NULL);
+	for (k = 0; k < nthreads; k++)
+	{
+		if (pthread_create(&p->threads[k],NULL,pool_worker,p) != 0) break;
+		p->nthreads++;
+	}
+	return p;
+}
+
+void pool_submit(struct pool *p, struct task *t)
+{
+	t->done = 0;
+	t->next = NULL;
+
+	pthread_mutex_lock(&p->lock);
+	if (p->tail != NULL)
+		p->tail->next = t;
+	else
+		p->head = t;
+	p->tail = t;
+	pthread_cond_signal(&p->work);
+	pthread_mutex_unlock(&p->lock);
+}
+
+void pool_wait(struct pool *p, struct task *t)
+{
+	pthread_mutex_lock(&p->lock);
+	while (!t->done)
+		pthread_cond_wait(&p->finished,&p->lock);
+	pthread_mutex_unlock(&p->lock);
+}
+
+void pool_destroy(struct pool *p)
+{
+	int k;
+
+	pthread_mutex_lock(&p->lock);
+	p->quit = 1;
+	pthread_cond_broadcast(&p->work);
+	pthread_mutex_unlock(&p->lock);
+
+	for (k = 0; k < p->nthreads; k++)
+		pthread_join(p->threads[k],NULL);
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->work);
+	pthread_cond_destroy(&p->finished);
+	free(p->threads);
+	free(p);
+}
+
+// A piece of a block handed to a worker.  Used both to build the index
+//  and to carve, with results kept until the merge picks them up.
+struct chunk_job
+{
+	struct task task;	// must be first
+	struct block *blk;
+	long start, end;	// owns tags starting in [start, end)
+
+	struct taglist thd, trk;
+
+	struct carve *carves;
+	long ncarves, capcarves;
+};
+
+void index_chunk(struct task *t)
+{
+	struct chunk_job *job = (struct chunk_job *)t;
+
+	index_range(job->blk,job->start,job->end,&job->thd,&job->trk);
+}
+
+// Pass one: record every tag starting in [blk->indexed, blk->avail - 3).
+//  With a pool the range is cut into chunks indexed side by side; each
+//  chunk owns the tags that start inside it, so stitching the chunk lists
+//  back together in order gives the same sorted index.
+void index_block(struct block *blk)
+{
+	long from = blk->indexed, to = blk->avail - 3, nchunks, k, n;
+	struct chunk_job *jobs;
+
+	if (to <= from) return;
+
+	nchunks = (to - from + chunk_size - 1) / chunk_size;
+	if (pool == NULL || nchunks < 2)
+	{
+		// still a chunk at a time, so progress moves while it runs
+		for (k = from; k < to; k += chunk_size)
+		{
+			n = blk->thd.n + blk->trk.n;
+			index_range(blk,k,k + chunk_size < to ? k + chunk_size : to,&blk->thd,&blk->trk);
+			progress_indexed(blk->img,blk->base + (k + chunk_size < to ? k + chunk_size : to),blk->thd.n + blk->trk.n - n);
+		}
+		blk->indexed = to;
+		return;
+	}
+
+	jobs = calloc(nchunks,sizeof(struct chunk_job));
+	if (jobs == NULL)
+	{
+		fprintf(stderr,"Out of memory indexing in parallel!\n");
+		exit(-1);
+	}
+	for (k = 0; k < nchunks; k++)
+	{
+		jobs[k].task.run = index_chunk;
+		jobs[k].blk = blk;
+		jobs[k].start = from + k * chunk_size;
+		jobs[k].end = jobs[k].start + chunk_size < to ? jobs[k].start + chunk_size : to;
+		pool_submit(pool,&jobs[k].task);
+	}
+	for (k = 0; k < nchunks; k++)
+	{
+		PROF_BEGIN(PROF_MERGE_WAIT);
+		pool_wait(pool,&jobs[k].task);
+		PROF_END(PROF_MERGE_WAIT);
+		progress_indexed(blk->img,blk->base + jobs[k].end,jobs[k].thd.n + jobs[k].trk.n);
+		index_append(&blk->thd,&jobs[k].thd);
+		index_append(&blk->trk,&jobs[k].trk);
+	}
+	free(jobs);
+	blk->indexed = to;
+}
+
+// Scores the track whose MTrk tag is at buffer without building anything,
+//  so junk that merely contains "MTrk" can be dropped before we allocate.
+int track_score(const unsigned char *buffer, unsigned long avail)
+{
+	unsigned long size;
+	struct smf_check chk;
+
+	if (avail < 8) return 0;
+	size = ((unsigned long)buffer[4] << 24) | (buffer[5] << 16) | (buffer[6] << 8) | buffer[7];
+	if (size > avail - 8) size = avail - 8;
+	smf_walk(&buffer[8],size,&chk);
+	return chk.score;
+}
+
+// Carves whatever starts at tag i.  t and h are the next MTrk and MThd at or
+//  after i.  Fills in out (midi is NULL if there was nothing worth keeping)
+//  and returns where scanning should resume.
+long carve_at(struct block *blk, long i, long t, long h, struct carve *out)
+{
+	long reach,stop;
+	struct mthd *midi;
+	struct arena *a;
+	struct timespec t0,t1;
+	PROF_BEGIN(PROF_CARVE);
+
+	PROF_COUNT(CNT_CARVES,1);
+	out->start = i;
+	out->img = blk->img;
+	out->midi = NULL;
+	out->checkpoint = 0;
+	if (blk->img->manifest != NULL)
+		clock_gettime(CLOCK_MONOTONIC,&t0);
+
+	// no carve may look further than the window
+	reach = blk->avail - i;
+	if (reach > (long)window) reach = window;
+
+// MTrk outside of an MThd.
+//   This is an orphan MTrk, which would need a new generic MThd to contain it.
+	if (i == t)
+	{
+		PROF_BEGIN(PROF_ORPHAN);
+		if (min_score > 0 && track_score(&blk->data[i],reach) < min_score)
+		{
+			PROF_END(PROF_ORPHAN);
+			PROF_COUNT(CNT_ORPHANS_IGNORED,1);
+			note("Ignoring an MTrk at %ld, it doesn't look like MIDI data.\n",blk->base+i);
+			out->end = i + 1;
+			PROF_END(PROF_CARVE);
+			return out->end;
+		}
+
+		note("**********************\nFound an orphan MIDI Track at %ld, source is maybe fragmented. : (\n", blk->base+i);
+		note(" Generating a default type 1 MThd.\n");
+		a = arena_get();
+		midi=arena_alloc(a,sizeof(struct mthd));
+		midi->arena=a;
+		midi->track0=NULL;
+		midi->miditype=1;
+		midi->timecode=120;
+		midi->numtracks = 0;
+		midi->is_damaged=1;
+		midi->is_generated=1;
+		midi->damage=DMG_ORPHAN;
+		midi->lost=0;
+		midi->carve_ns=0;
+		note(" Counting MTrks from here to next MThd...");
+
+		stop = i + reach - 3;
+		if (h >= 0 && h < stop) stop = h;
+		midi->numtracks = index_lower(&blk->trk,stop) - index_lower(&blk->trk,i);
+		PROF_END(PROF_ORPHAN);
+		note(" found %hd MTrk tags.  Beginning extraction.\n",midi->numtracks);
+		midi->expected = midi->numtracks;
+		out->offset = blk->base + i;
+		stop = smart_extract(midi,blk,i,i+reach,32768);
+		// too near the end for even a track header: move on, or the
+		//  same tag would be carved again forever
+		if (stop == 0)
+		{
+			arena_release(a);
+			out->end = i + 1;
+			PROF_END(PROF_CARVE);
+			return out->end;
+		}
+		i += stop;
+	} else {
+		note("*********************************\nFound a MIDI Header starting at %ld\n",blk->base+i);
+// Extract the header and advance the buffer pointer.
+		a = arena_get();
+		midi = extract_mthd(&blk->data[i],reach,a);
+		if (midi == NULL)
+		{
+			arena_release(a);
+			out->end = i + 1;
+			PROF_END(PROF_CARVE);
+			return out->end;
+		}
+		out->offset = blk->base + i;
+		i += 14;
+
+		i += smart_extract(midi,blk,i,i+reach-14,32768);
+	}
+	if (blk->img->manifest != NULL)
+	{
+		clock_gettime(CLOCK_MONOTONIC,&t1);
+		midi->carve_ns = (t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec);
+	}
+	out->midi = midi;
+	out->end = i;
+	PROF_END(PROF_CARVE);
+	return i;
+}
+
+// Looks for an earlier MIDI with this hash and length.
+struct seen *dedup_find(struct dedup *d, unsigned long long hash, unsigned long length)
+{
+	unsigned long k;
+
+	if (d->cap == 0) return NULL;
+	for (k = hash & (d->cap - 1); d->slot[k].length != 0; k = (k + 1) & (d->cap - 1))
+		if (d->slot[k].hash == hash && d->slot[k].length == length)
+			return &d->slot[k];
+	return NULL;
+}
+
+// Remembers a MIDI that was written, growing the table at half full.
+void dedup_add(struct dedup *d, unsigned long long hash, unsigned long length, long offset, const char *status)
+{
+	struct seen *old = d->slot;
+	unsigned long oldcap = d->cap,k;
+
+	if (2 * (d->n + 1) > d->cap)
+	{
+		d->cap = oldcap ? 2 * oldcap : 4096;
+		d->slot = calloc(d->cap,sizeof(struct seen));
+		if (d->slot == NULL)
+		{
+			fprintf(stderr,"Out of memory growing the duplicate table!\n");
+			exit(1);
+		}
+		d->n = 0;
+		for (k = 0; k < oldcap; k++)
+			if (old[k].length != 0)
+				dedup_add(d,old[k].hash,old[k].length,old[k].offset,old[k].status);
+		free(old);
+	}
+
+	for (k = hash & (d->cap - 1); d->slot[k].length != 0; k = (k + 1) & (d->cap - 1))
+		;
+	d->slot[k].hash = hash;
+	d->slot[k].length = length;
+	d->slot[k].offset = offset;
+	d->slot[k].status = status;
+	d->n++;
+}
+
+// Writes s as a CSV field or JSON string.
+void manifest_string(FILE *f, const char *s)
+{
+	if (manifest_csv && strpbrk(s,",\"\n") == NULL)
+	{
+		fputs(s,f);
+		return;
+	}
+	fputc('"',f);
+	for (; *s != '\0'; s++)
+	{
+		if (*s == '"')
+			fputs(manifest_csv ? "\"\"" : "\\\"",f);
+		else if (*s == '\\' && !manifest_csv)
+			fputs("\\\\",f);
+		else
+			fputc(*s,f);
+	}
+	fputc('"',f);
+}
+
+// Appends a carve's record to its image's manifest.  name is the file
+//  name without the directory; length and hash describe the bytes written.
+//  A duplicate isn't written and names the earlier copy in dup_of.  In a
+//  batch the record ends with the image it came from.
+void manifest_record(struct carve *c, const char *name, const char *status, unsigned long length, unsigned long long hash, unsigned long write_ns, int written, const char *dup_of)
+{
+	struct mthd *midi = c->midi;
+	FILE *manifest = c->img->manifest;
+	int k,first=1;
+
+	if (manifest_csv)
+	{
+		fprintf(manifest,"%s,%s,%ld,%ld,%lu,%hu,%hu,%lu,",
+			name,status,c->offset,c->end - c->start,length,midi->expected,midi->numtracks,midi->lost);
+		for (k = 0; k < (int)(sizeof(dmg_names) / sizeof(dmg_names[0])); k++)
+			if (midi->damage & (1 << k))
+			{
+				fprintf(manifest,"%s%s",first ? "" : "|",dmg_names[k]);
+				first = 0;
+			}
+		fprintf(manifest,",%016llx,%lu,%lu,%d,%s",hash,midi->carve_ns,write_ns,written,dup_of ? dup_of : "");
+		if (batch)
+		{
+			fputc(',',manifest);
+			manifest_string(manifest,c->img->path);
+		}
+		fputc('\n',manifest);
+	} else {
+		fprintf(manifest,"{\"file\":\"%s\",\"status\":\"%s\",\"offset\":%ld,\"consumed\":%ld,\"length\":%lu,"
+			"\"tracks_expected\":%hu,\"tracks_found\":%hu,\"lost\":%lu,\"damage\":[",
+			name,status,c->offset,c->end - c->start,length,midi->expected,midi->numtracks,midi->lost);
+		for (k = 0; k < (int)(sizeof(dmg_names) / sizeof(dmg_names[0])); k++)
+			if (midi->damage & (1 << k))
+			{
+				fprintf(manifest,"%s\"%s\"",first ? "" : ",",dmg_names[k]);
+				first = 0;
+			}
+		fprintf(manifest,"],\"xxh64\":\"%016llx\",\"carve_ns\":%lu,\"write_ns\":%lu,\"written\":%s,",
+			hash,midi->carve_ns,write_ns,written ? "true" : "false");
+		if (dup_of != NULL)
+			fprintf(manifest,"\"dup_of\":\"%s\"",dup_of);
+		else
+			fprintf(manifest,"\"dup_of\":null");
+		if (batch)
+		{
+			fprintf(manifest,",\"image\":");
+			manifest_string(manifest,c->img->path);
+		}
+		fprintf(manifest,"}\n");
+	}
+}
+
+// Turns a status read back from a checkpoint into the string write_carve
+//  would have used.
+const char *status_name(const char *s)
+{
+	if (strcmp(s,"OK") == 0) return "OK";
+	if (strcmp(s,"ORPH") == 0) return "ORPH";
+	return "BAD";
+}
+
+// Saves a checkpoint saying the scan can resume at offset.  Called by the
+//  writer once every carve before offset is written, so nothing before it
+//  needs to be carved again.  The file is written beside the real one,
+//  synced and renamed over it, so a crash leaves either the old checkpoint
+//  or the new one, never half of one.
+void checkpoint_write(struct image *img, long offset)
+{
+	char tmp[1040],final[1040];
+	FILE *f;
+	unsigned long k;
+	long mlen = -1;
+	int dfd,ok;
+
+	snprintf(tmp,sizeof(tmp),"%s/%s.tmp",img->out_dir,CHECKPOINT_NAME);
+	snprintf(final,sizeof(final),"%s/%s",img->out_dir,CHECKPOINT_NAME);
+
+	// the manifest must hold every record the checkpoint counts
+	if (img->manifest != NULL)
+	{
+		fflush(img->manifest);
+		fsync(fileno(img->manifest));
+		mlen = ftell(img->manifest);
+	}
+
+	f = fopen(tmp,"w");
+	if (f == NULL)
+	{
+		log_msg(LOG_SUMMARY," ERROR: could not open %s for writing!!\n",tmp);
+		return;
+	}
+	fprintf(f,"midi-carver checkpoint 1\nsize %ld\noffset %ld\nfiles %lu %lu %lu\nmanifest %ld\nseen %lu\n",
+		img->size,offset,img->files_written,img->files_duplicate,img->files_failed,mlen,img->dedup.n);
+	for (k = 0; k < img->dedup.cap; k++)
+		if (img->dedup.slot[k].length != 0)
+			fprintf(f,"%016llx %lu %ld %s\n",img->dedup.slot[k].hash,img->dedup.slot[k].length,img->dedup.slot[k].offset,img->dedup.slot[k].status);
+	ok = (fflush(f) == 0 && fsync(fileno(f)) == 0);
+	if (fclose(f) != 0) ok = 0;
+
+	if (!ok || rename(tmp,final) != 0)
+	{
+		log_msg(LOG_SUMMARY," ERROR: could not write %s!!\n",final);
+		unlink(tmp);
+		return;
+	}
+
+	// make the rename itself durable
+	dfd = open(img->out_dir,O_RDONLY);
+	if (dfd >= 0)
+	{
+		fsync(dfd);
+		close(dfd);
+	}
+	log_msg(LOG_FILE," Checkpoint: everything before %ld is written.\n",offset);
+}
+
+// Reads the checkpoint back for --resume.  Restores the counters and the
+//  duplicate table, and hands back the offset to resume at and the length
+//  the manifest had (-1 if there wasn't one).  Returns 0 on success.
+int checkpoint_load(struct image *img, long *offset, long *mlen)
+{
+	char name[1040],status[8];
+	FILE *f;
+	long size,off;
+	unsigned long n,k,length;
+	unsigned long long hash;
+	int version;
+
+	snprintf(name,sizeof(name),"%s/%s",img->out_dir,CHECKPOINT_NAME);
+	f = fopen(name,"r");
+	if (f == NULL)
+	{
+		fprintf(stderr,"No checkpoint at %s to resume from.\n",name);
+		return -1;
+	}
+
+	if (fscanf(f,"midi-carver checkpoint %d size %ld offset %ld files %lu %lu %lu manifest %ld seen %lu",
+		&version,&size,offset,&img->files_written,&img->files_duplicate,&img->files_failed,mlen,&n) != 8 || version != 1)
+	{
+		fprintf(stderr,"%s is not a checkpoint this carver understands.\n",name);
+		fclose(f);
+		return -1;
+	}
+	// a pipe's size isn't known until it ends, so there's nothing to check
+	if (size != img->size && img->size >= 0)
+	{
+		fprintf(stderr,"%s is for a %ld byte image, not this one.\n",name,size);
+		fclose(f);
+		return -1;
+	}
+
+	for (k = 0; k < n; k++)
+	{
+		if (fscanf(f,"%llx %lu %ld %7s",&hash,&length,&off,status) != 4)
+		{
+			fprintf(stderr,"%s is cut short.\n",name);
+			fclose(f);
+			return -1;
+		}
+		dedup_add(&img->dedup,hash,length,off,status_name(status));
+	}
+	fclose(f);
+	return 0;
+}
+
+// Names and writes a finished carve.
+void write_carve(struct carve *c)
+{
+	char output_filename[1040],name[40],dup_of[40];
+	struct mthd *midi = c->midi;
+	struct image *img = c->img;
+	const char *status;
+	struct iovec *iov;
+	struct xxh64 hash;
+	struct timespec t0,t1;
+	struct seen *prev;
+	unsigned long length=0;
+	unsigned long long h=0;
+	int n,k,ret;
+
+	if (c->checkpoint)
+	{
+		checkpoint_write(img,c->offset);
+		c->checkpoint = 0;
+		return;
+	}
+	if (midi == NULL) return;
+
+	if (midi->track0 == NULL)
+	{
+		log_msg(LOG_FILE," Refusing to write trackless MIDI file.\n");
+		free_midi(midi);
+		c->midi = NULL;
+		return;
+	}
+
+	if (midi->is_generated == 1)
+		status = "ORPH";
+	else if (midi->is_damaged == 0)
+		status = "OK";
+	else
+		status = "BAD";
+	sprintf(name,"mc-%08ld-%s.mid",c->offset,status);
+	snprintf(output_filename,sizeof(output_filename),"%s/%s",img->out_dir,name);
+
+	iov = midi_iov(midi,&n);
+	if (img->manifest != NULL || !keep_duplicates)
+	{
+		// hash before writing: writev_all uses the list up
+		PROF_BEGIN(PROF_HASH);
+		xxh64_init(&hash);
+		for (k = 0; k < n; k++)
+		{
+			xxh64_update(&hash,iov[k].iov_base,iov[k].iov_len);
+			length += iov[k].iov_len;
+		}
+		h = xxh64_final(&hash);
+		PROF_END(PROF_HASH);
+	}
+
+	// already written this exact file?
+	if (!keep_duplicates && (prev = dedup_find(&img->dedup,h,length)) != NULL)
+	{
+		sprintf(dup_of,"mc-%08ld-%s.mid",prev->offset,prev->status);
+		log_msg(LOG_FILE," Duplicate of %s, not writing %s.\n",dup_of,name);
+		img->files_duplicate++;
+		atomic_fetch_add_explicit(&progress.files,1,memory_order_relaxed);
+		if (img->manifest != NULL)
+			manifest_record(c,name,status,length,h,0,0,dup_of);
+		free_midi(midi);
+		c->midi = NULL;
+		return;
+	}
+
+	if (img->manifest != NULL)
+		clock_gettime(CLOCK_MONOTONIC,&t0);
+
+	PROF_BEGIN(PROF_WRITE);
+	ret = write_midi(iov,n,output_filename);
+	PROF_END(PROF_WRITE);
+	if (ret == 0)
+	{
+		img->files_written++;
+		atomic_fetch_add_explicit(&progress.files,1,memory_order_relaxed);
+		if (!keep_duplicates)
+			dedup_add(&img->dedup,h,length,c->offset,status);
+	} else
+		img->files_failed++;
+
+	if (img->manifest != NULL)
+	{
+		clock_gettime(CLOCK_MONOTONIC,&t1);
+		manifest_record(c,name,status,length,h,
+			(t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec),ret == 0,NULL);
+	}
+
+	free_midi(midi);
+	c->midi = NULL;
+}
+
+void *writer_main(void *arg)
+{
+	struct write_queue *q = arg;
+	struct carve c;
+
+	pthread_mutex_lock(&q->lock);
+	while (1)
+	{
+		while (q->count == 0 && !q->quit)
+			pthread_cond_wait(&q->not_empty,&q->lock);
+		if (q->count == 0) break;
+
+		c = q->items[q->head];
+		q->head = (q->head + 1) % q->cap;
+		q->count--;
+		pthread_cond_signal(&q->not_full);
+
+		pthread_mutex_unlock(&q->lock);
+		write_carve(&c);
+		pthread_mutex_lock(&q->lock);
+
+		q->written++;
+		pthread_cond_broadcast(&q->written_one);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return NULL;
+}
+
+// Starts the writer thread with room for depth carves.  NULL if it can't
+//  be started, and then carves are written as they're made (as with -q 0).
+struct write_queue *writer_start(int depth)
+{
+	struct write_queue *q = calloc(1,sizeof(struct write_queue));
+
+	if (q == NULL) return NULL;
+	q->cap = depth;
+	q->items = calloc(depth,sizeof(struct carve));
+	if (q->items == NULL)
+	{
+		free(q);
+		return NULL;
+	}
+	pthread_mutex_init(&q->lock,NULL);
+	pthread_cond_init(&q->not_empty,NULL);
+	pthread_cond_init(&q->not_full,NULL);
+	pthread_cond_init(&q->written_one,NULL);
+	if (pthread_create(&q->thread,NULL,writer_main,q) != 0)
+	{
+		free(q->items);
+		free(q);
+		return NULL;
+	}
+	return q;
+}
+
+// Hands a carve to the writer, waiting for room if the queue is full.
+void writer_push(struct write_queue *q, struct carve *c)
+{
+	PROF_BEGIN(PROF_QUEUE_WAIT);
+
+	pthread_mutex_lock(&q->lock);
+	while (q->count == q->cap)
+		pthread_cond_wait(&q->not_full,&q->lock);
+	PROF_END(PROF_QUEUE_WAIT);
+	q->items[(q->head + q->count) % q->cap] = *c;
+	q->count++;
+	q->pushed++;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+	c->midi = NULL;
+}
+
+// Waits until everything queued so far is on disk.  Queued tracks point
+//  into the input, so this must be called before that memory is reused.
+//  Carves other images queue in the meantime aren't waited for.
+void writer_flush(struct write_queue *q)
+{
+	unsigned long target;
+
+	if (q == NULL) return;
+
+	pthread_mutex_lock(&q->lock);
+	target = q->pushed;
+	while (q->written < target)
+		pthread_cond_wait(&q->written_one,&q->lock);
+	pthread_mutex_unlock(&q->lock);
+}
+
+// Writes out whatever is still queued and stops the thread.
+void writer_stop(struct write_queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->quit = 1;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+
+	pthread_join(q->thread,NULL);
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->not_empty);
+	pthread_cond_destroy(&q->not_full);
+	pthread_cond_destroy(&q->written_one);
+	free(q->items);
+	free(q);
+}
+
+// Passes a finished carve on for writing, in image order.
+void emit_carve(struct carve *c)
+{
+	if (c->midi == NULL && !c->checkpoint) return;
+
+	if (writer != NULL)
+		writer_push(writer,c);
+	else
+		write_carve(c);
+}
+
+// Called as the serial scan moves on: every carve that starts before
+//  block position i has been emitted.  Once a checkpoint is due, queues a
+//  marker for the writer.
+void checkpoint_mark(struct block *blk, long i)
+{
+	struct carve c;
+	time_t now;
+
+	if (checkpoint_every <= 0) return;
+	now = time(NULL);
+	if (now < blk->img->checkpoint_next) return;
+	blk->img->checkpoint_next = now + checkpoint_every;
+
+	memset(&c,0,sizeof(c));
+	c.img = blk->img;
+	c.checkpoint = 1;
+	c.offset = blk->base + i;
+	emit_carve(&c);
+}
+
+// Next tag at or after i, or -1.  Also hands back the next MTrk and MThd.
+long next_tag(struct block *blk, long i, long *t, long *h)
+{
+	*t = index_next(&blk->trk,i);
+	*h = index_next(&blk->thd,i);
+	if (*t >= 0 && (*h < 0 || *t < *h)) return *t;
+	return *h;
+}
+
+// Pass two, one thread: carves the tags in blk that start at i or later
+//  and before limit.  A carve begun before limit may consume data past it,
+//  up to the window.  Returns the position the scan stopped at (>= limit).
+long carve_range(struct block *blk, long i, long limit)
+{
+	long p,t,h;
+	struct carve c;
+
+	while ((p = next_tag(blk,i,&t,&h)) >= 0 && p < limit)
+	{
+		i = carve_at(blk,p,t,h,&c);
+		emit_carve(&c);
+		checkpoint_mark(blk,i);
+		atomic_store_explicit(&blk->img->offset,blk->base + i,memory_order_relaxed);
+	}
+	atomic_store_explicit(&blk->img->offset,blk->base + (i > limit ? i : limit),memory_order_relaxed);
+	return i > limit ? i : limit;
+}
+
+// Worker side of pass two: carve the chunk as if the scan had arrived at
+//  its first byte with nothing in progress.  This is a guess - a carve from
+//  the previous chunk may run into this one - which the merge fixes up.
+void carve_chunk(struct task *task)
+{
+	struct chunk_job *job = (struct chunk_job *)task;
+	long i = job->start, p, t, h;
+	struct carve c, *grown;
+
+	while ((p = next_tag(job->blk,i,&t,&h)) >= 0 && p < job->end)
+	{
+		i = carve_at(job->blk,p,t,h,&c);
+		if (c.midi == NULL) continue;
+
+		if (job->ncarves == job->capcarves)
+		{
+			job->capcarves = job->capcarves ? job->capcarves * 2 : 16;
+			grown = realloc(job->carves,job->capcarves * sizeof(struct carve));
+			if (grown == NULL)
+			{
+				fprintf(stderr,"Out of memory holding a chunk's carves!\n");
+				free(job->carves);
+				exit(-1);
+			}
+			job->carves = grown;
+		}
+		job->carves[job->ncarves++] = c;
+	}
+}
+
+// Merges one chunk's carves into the serial result.  g is where the serial
+//  scan stands.  A speculative carve is kept when it starts at or after g
+//  and every carve the worker made before it ended by g: from there the
+//  worker and a serial scan see exactly the same next tag.  While g sits
+//  inside a speculative carve the worker's view is wrong, so we carve
+//  serially from g until the two line up again.  Carves are emitted
+//  strictly in image order, so the files match a one-thread run.
+long merge_chunk(struct chunk_job *job, long g)
+{
+	struct block *blk = job->blk;
+	long r = 0, p, t, h;
+	struct carve c;
+
+	if (g < job->start) g = job->start;
+
+	while (1)
+	{
+		while (r < job->ncarves && job->carves[r].end <= g)
+		{
+			PROF_COUNT(CNT_SPECULATIVE_DROPPED,1);
+			free_midi(job->carves[r++].midi);
+		}
+
+		if (r < job->ncarves && job->carves[r].start >= g)
+		{
+			g = job->carves[r].end;
+			emit_carve(&job->carves[r++]);
+			continue;
+		}
+
+		if (r == job->ncarves) break;
+
+		// g is inside carves[r]: catch up by hand
+		p = next_tag(blk,g,&t,&h);
+		if (p < 0 || p >= job->end) break;
+		g = carve_at(blk,p,t,h,&c);
+		PROF_COUNT(CNT_CATCHUP_CARVES,1);
+		emit_carve(&c);
+	}
+
+	while (r < job->ncarves)
+	{
+		PROF_COUNT(CNT_SPECULATIVE_DROPPED,1);
+		free_midi(job->carves[r++].midi);
+	}
+	free(job->carves);
+	job->carves = NULL;
+	job->ncarves = job->capcarves = 0;
+	return g;
+}
+
+// Pass two across the pool.  Chunks are carved ahead of the merge, but no
+//  more than a couple per thread, so finished carves don't pile up.
+long carve_parallel(struct block *blk, long i, long limit)
+{
+	long nchunks, k, ahead, g = i;
+	struct chunk_job *ring, *job;
+
+	nchunks = (limit - i + chunk_size - 1) / chunk_size;
+	if (nchunks < 2) return carve_range(blk,i,limit);
+
+	ahead = pool->nthreads * 2;
+	if (ahead > nchunks) ahead = nchunks;
+	ring = calloc(ahead,sizeof(struct chunk_job));
+	if (ring == NULL)
+	{
+		fprintf(stderr,"Out of memory carving in parallel!\n");
+		exit(-1);
+	}
+
+	for (k = 0; k < nchunks + ahead; k++)
+	{
+		job = &ring[k % ahead];
+		if (k >= ahead)
+		{
+			PROF_BEGIN(PROF_MERGE_WAIT);
+			pool_wait(pool,&job->task);
+			PROF_END(PROF_MERGE_WAIT);
+			g = merge_chunk(job,g);
+			checkpoint_mark(blk,g);
+			atomic_store_explicit(&blk->img->offset,blk->base + g,memory_order_relaxed);
+		}
+		if (k < nchunks)
+		{
+			job->task.run = carve_chunk;
+			job->blk = blk;
+			job->start = i + k * chunk_size;
+			job->end = job->start + chunk_size < limit ? job->start + chunk_size : limit;
+			pool_submit(pool,&job->task);
+		}
+	}
+	free(ring);
+	atomic_store_explicit(&blk->img->offset,blk->base + (g > limit ? g : limit),memory_order_relaxed);
+	return g > limit ? g : limit;
+}
+
+// Pass two, using the pool if there is one.
+long carve_block(struct block *blk, long i, long limit)
+{
+	if (pool == NULL) return carve_range(blk,i,limit);
+	return carve_parallel(blk,i,limit);
+}
+
+// Moves img's input on to offset n.  A pipe can't seek, so the bytes up
+//  to there are read into buf (len bytes long) and thrown away.  0 on
+//  success.
+int stream_skip(struct image *img, unsigned char *buf, long len, long n)
+{
+	ssize_t got;
+	int fd = img->fd;
+
+	if (image_seek(img,n) == 0) return 0;
+	if (errno != ESPIPE)
+	{
+		perror("lseek");
+		return -1;
+	}
+
+	while (n > 0)
+	{
+		got = read(fd,buf,n < len ? n : len);
+		if (got < 0 && errno == EINTR) continue;
+		if (got <= 0)
+		{
+			if (got < 0)
+				perror("read");
+			else
+				fprintf(stderr,"Input ended %ld bytes before the resume offset.\n",n);
+			return -1;
+		}
+		n -= got;
+	}
+	return 0;
+}
+
+// Stream mode: carve from fd using a fixed buffer of max_memory bytes.
+//  Each pass scans everything but the last window bytes, then carries the
+//  unscanned tail (at most one window, since no carve reads further than
+//  that) to the front of the buffer and refills the rest.  Scanning
+//  begins at image offset start.  Nothing is sought but that and the ends
+//  of holes, so this works on a pipe too; a split image is read segment
+//  by segment, and the carry-over joins each to the next.
+//  Holes are zero-filled instead of read.  One longer than the window
+//   ends the buffer early, like the end of the file would: nothing carved
+//   before it can reach past the window's worth of zeros, so the rest of
+//   the hole is jumped over and scanning starts again on the far side.
+int carve_stream(struct image *img)
+{
+	struct block blk;
+	struct hole *h;
+	long i=0,limit,pos,room,brk,start=img->start;
+	ssize_t got;
+	int fd=img->fd,eof=0,failed=0,k;
+
+	if (max_memory < 2 * window)
+	{
+		fprintf(stderr,"Memory limit must be at least twice the window (%lu MB).\n",2 * window / (1024 * 1024));
+		return -1;
+	}
+
+	memset(&blk,0,sizeof(blk));
+	blk.img = img;
+	blk.base = start;
+	blk.data = malloc(max_memory);
+	if (blk.data == NULL)
+	{
+		fprintf(stderr,"Could not allocate %lu bytes for the stream buffer!\n",max_memory);
+		return -1;
+	}
+
+	if (start > 0 && stream_skip(img,blk.data,max_memory,start) != 0)
+	{
+		free(blk.data);
+		return -1;
+	}
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd,0,0,POSIX_FADV_SEQUENTIAL);
+	for (k = 1; k < img->nsegs; k++)
+		posix_fadvise(img->segs[k].fd,0,0,POSIX_FADV_SEQUENTIAL);
+#endif
+
+	log_msg(LOG_SUMMARY,"INFO: Streaming with a %lu MB buffer and %lu MB window\n",max_memory / (1024 * 1024),window / (1024 * 1024));
+
+	while (1)
+	{
+		brk = -1;
+		while (!eof && blk.avail < (long)max_memory)
+		{
+			pos = blk.base + blk.avail;
+			room = max_memory - blk.avail;
+			h = img->nholes > 0 ? hole_after(img,pos) : NULL;
+			if (h != NULL && h->start <= pos)
+			{
+				if (h->end - pos > (long)window && room >= (long)window)
+				{
+					memset(&blk.data[blk.avail],0,window);
+					blk.avail += window;
+					brk = h->end;
+					break;
+				}
+				if (room > h->end - pos) room = h->end - pos;
+				memset(&blk.data[blk.avail],0,room);
+				blk.avail += room;
+				if (pos + room == h->end && image_seek(img,h->end) != 0)
+				{
+					perror("lseek");
+					eof = failed = 1;
+				}
+				continue;
+			}
+			if (h != NULL && h->start - pos < room) room = h->start - pos;
+
+			got = image_read(img,&blk.data[blk.avail],room,pos);
+			if (got < 0 && errno == EINTR)
+				continue;
+			if (got < 0)
+			{
+				perror("read");
+				eof = failed = 1;
+			} else if (got == 0)
+				eof = 1;
+			else
+				blk.avail += got;
+		}
+
+		index_block(&blk);
+		limit = eof || brk >= 0 ? blk.avail : blk.avail - (long)window;
+		i = carve_block(&blk,i,limit);
+		writer_flush(writer);
+		if (eof)
+		{
+			// a pipe's size is only known now it has ended
+			if (img->size < 0)
+				img->size = blk.base + blk.avail;
+			break;
+		}
+
+		if (brk >= 0)
+		{
+			atomic_fetch_add_explicit(&skipped_holes,brk - blk.base - blk.avail,memory_order_relaxed);
+			if (image_seek(img,brk) != 0)
+			{
+				perror("lseek");
+				failed = 1;
+				break;
+			}
+			blk.thd.n = 0;
+			blk.trk.n = 0;
+			blk.base = brk;
+			blk.avail = 0;
+			blk.indexed = 0;
+			i = 0;
+			continue;
+		}
+
+		memmove(blk.data,&blk.data[i],blk.avail - i);
+		block_shift(&blk,i);
+		blk.base += i;
+		blk.avail -= i;
+		i = 0;
+	}
+
+	index_free(&blk.thd);
+	index_free(&blk.trk);
+	free(blk.data);
+	return failed ? -1 : 0;
+}
+
+// Stream mode's double-buffered reader, for --uring.  One buffer is carved
+//  while the reads for the next stretch of the image land in the other.
+//  Each buffer keeps window bytes free in front of its data, where the
+//  unscanned tail of the buffer before it is copied, so the two join up
+//  without moving more than that tail.
+struct reader
+{
+	struct image *img;
+	int fd, uring, direct, failed;
+	int probed;		// a read has come back, so IORING_OP_READ works
+	int no_read;		// it doesn't: the first came back -EINVAL
+	struct uring ring;
+	unsigned char *buf[2];
+	long room;		// bytes read into a buffer per fill
+	long size;		// where the image ends
+	long off[2];		// image offset each buffer is filled from
+	long len[2];		// bytes it holds once full; cut short by errors
+	long next[2];		// first byte not yet asked for
+	int inflight[2];
+};
+
+// End of the read that starts p bytes into buffer b.
+long reader_chunk_end(struct reader *r, int b, long p)
+{
+	long e = (p / IO_CHUNK + 1) * IO_CHUNK;
+	return e < r->len[b] ? e : r->len[b];
+}
+
+// Asks for as much of buffer b as the ring has room for.  Stretches that
+//  are all hole are zeroed instead of read.
+void reader_queue(struct reader *r, int b)
 {
-	unsigned char buffer[4];
+	struct hole *h;
+	long p,e,n,got;
 
-	if (track == NULL || fp == NULL) return;
+	while (r->next[b] < r->len[b])
+	{
+		if (r->uring && r->inflight[0] + r->inflight[1] >= IO_DEPTH) break;
 
-	// convert size to device-independent buffer
-	buffer[0] = ((track->size) / 1677216);
-	buffer[1] = (((track->size) % 1677216) / 65536);
-	buffer[2] = (((track->size) % 65536) / 256);
-	buffer[3] = ((track->size) % 256);
+		p = r->next[b];
+		e = reader_chunk_end(r,b,p);
+		h = r->img->nholes > 0 ? hole_after(r->img,r->off[b] + p) : NULL;
+		if (h != NULL && h->start <= r->off[b] + p && h->end >= r->off[b] + e)
+		{
+			memset(&r->buf[b][window + p],0,e - p);
+			r->next[b] = e;
+			continue;
+		}
 
-	// write track to disk
-	fwrite("MTrk",1,4,fp);
-	fwrite(buffer,1,4,fp);
-	fwrite(track->data,1,track->size,fp);
+		// O_DIRECT can only read whole blocks; the last may run past the end
+		n = e - p;
+		if (r->direct) n = (n + IO_ALIGN - 1) / IO_ALIGN * IO_ALIGN;
 
-	// recursively write next track
-	if (track->next != NULL)
-		write_mtrk(track->next,fp);
+		if (r->uring)
+		{
+			if (uring_read(&r->ring,r->fd,&r->buf[b][window + p],n,r->off[b] + p,(unsigned long long)p * 2 + b) != 0) break;
+			r->inflight[b]++;
+			r->next[b] = e;
+			continue;
+		}
 
-	// free current track
-	free(track->data);
-	free(track);
+		got = pread(r->fd,&r->buf[b][window + p],n,r->off[b] + p);
+		if (got < 0 && errno == EINTR) continue;
+		if (got <= 0)
+		{
+			if (got < 0)
+			{
+				perror("pread");
+				r->failed = 1;
+			}
+			r->len[b] = p;
+			break;
+		}
+		r->next[b] = p + got < e ? p + got : e;
+	}
 }
 
-int write_midi(struct mthd *midi, const char *filename)
+// A read into buffer b at p has finished with res (bytes, or -errno).
+void reader_done(struct reader *r, int b, long p, int res)
 {
-	FILE *fp = NULL;
-	unsigned char buffer[6];
+	long e = reader_chunk_end(r,b,p);
 
-	if (midi->track0 == NULL)
+	r->inflight[b]--;
+	// io_uring before Linux 5.6 has no IORING_OP_READ
+	if (res == -EINVAL && !r->probed)
 	{
-		printf(" Refusing to write trackless MIDI file.\n");
-		return 1;
+		r->no_read = 1;
+		return;
 	}
+	r->probed = 1;
+	if (p >= r->len[b] || res >= e - p) return;
 
-	fp = fopen(filename,"wb");
-	if (fp == NULL)
+	if (res < 0 || (res > 0 && r->direct))
 	{
-		printf(" ERROR: could not open %s for writing!!\n",filename);
-		return 1;
+		if (res < 0)
+			fprintf(stderr,"read: %s\n",strerror(-res));
+		else
+			fprintf(stderr,"read: short O_DIRECT read at %ld\n",r->off[b] + p);
+		r->failed = 1;
+		r->len[b] = p;
+	} else if (res == 0)
+		r->len[b] = p;	// the image got shorter
+	else if (uring_read(&r->ring,r->fd,&r->buf[b][window + p + res],e - p - res,r->off[b] + p + res,(unsigned long long)(p + res) * 2 + b) == 0)
+		r->inflight[b]++;
+	else
+	{
+		r->failed = 1;
+		r->len[b] = p + res;
 	}
+}
 
-	buffer[0] = ((midi->miditype) / 256);
-	buffer[1] = ((midi->miditype) % 256);
-	buffer[2] = ((midi->numtracks) / 256);
-	buffer[3] = ((midi->numtracks) % 256);
-	buffer[4] = ((midi->timecode) / 256);
-	buffer[5] = ((midi->timecode) % 256);
+// Gives up on io_uring when the kernel can't read through it: waits out
+//  what's still in flight, then asks for both buffers again with pread.
+void reader_fallback(struct reader *r)
+{
+	unsigned long long tag;
+	int res;
 
-	fwrite("MThd\0\0\0\x06",1,8,fp);
-	fwrite(buffer,1,6,fp);
+	while (r->inflight[0] + r->inflight[1] > 0)
+	{
+		if (uring_submit(&r->ring,1) != 0)
+		{
+			perror("io_uring_enter");
+			exit(-1);
+		}
+		while (uring_reap(&r->ring,&tag,&res))
+			r->inflight[tag & 1]--;
+	}
+	uring_free(&r->ring);
+	r->uring = 0;
+	r->next[0] = r->next[1] = 0;
+	log_msg(LOG_SUMMARY,"INFO: io_uring can't read here, reading with pread\n");
+}
 
-	write_mtrk(midi->track0,fp);
+// Starts filling buffer b from image offset off.
+void reader_fill(struct reader *r, int b, long off)
+{
+	r->off[b] = off;
+	r->len[b] = r->size - off < r->room ? r->size - off : r->room;
+	if (r->len[b] < 0) r->len[b] = 0;
+	r->next[b] = 0;
+	if (!r->uring) return;
 
-	fclose(fp);
+	reader_queue(r,b);
+	if (uring_submit(&r->ring,0) != 0)
+	{
+		perror("io_uring_enter");
+		exit(-1);
+	}
+}
 
-	free(midi);
+// Waits for buffer b to fill.  Returns how many bytes it holds.
+long reader_wait(struct reader *r, int b)
+{
+	unsigned long long tag;
+	int res;
 
-	printf(" Success!  Wrote %s to disk.\n",filename);
+	while (r->next[b] < r->len[b] || r->inflight[b] > 0)
+	{
+		reader_queue(r,b);
+		if (!r->uring) break;
 
-	return 0;
+		if (uring_submit(&r->ring,r->inflight[0] + r->inflight[1] > 0) != 0)
+		{
+			perror("io_uring_enter");
+			exit(-1);
+		}
+		while (uring_reap(&r->ring,&tag,&res))
+			reader_done(r,tag & 1,tag >> 1,res);
+		if (r->no_read)
+			reader_fallback(r);
+	}
+	return r->len[b];
 }
 
-// Extracts an MThd from a block.
-struct mthd *extract_mthd(unsigned char *buffer)
+// Stream mode with --uring: carves like carve_stream, but reads through
+//  the double-buffered reader so the next stretch is on its way while
+//  this one is carved.
+int carve_uring(struct image *img)
 {
-	struct mthd *newmidi = NULL;
-	unsigned int ipointer;
+	struct reader r;
+	struct block blk;
+	long i,limit,carry=0,off,start=img->start;
+	int fd=img->fd,cur=0,eof,b;
 
-// looks like a winner?
-	if (strncmp((char *)buffer,"MThd",4) == 0)
+	memset(&r,0,sizeof(r));
+	r.img = img;
+	r.fd = fd;
+	r.size = img->size > 0 ? img->size : lseek(fd,0,SEEK_END);	// a device has no st_size
+	r.room = ((long)max_memory / 2 - (long)window) / IO_CHUNK * IO_CHUNK;
+	if (r.room < IO_CHUNK)
 	{
-		newmidi = malloc(sizeof(struct mthd));
-		newmidi->track0=NULL;
-
-		newmidi->is_damaged=0;
-		newmidi->is_generated=0;
+		fprintf(stderr,"Memory limit must be at least twice the window plus %ld MB for --uring (%lu MB).\n",
+			2 * IO_CHUNK / (1024 * 1024),(2 * window + 2 * IO_CHUNK) / (1024 * 1024));
+		return -1;
+	}
 
-// Looks like a MIDI file, let's check for consistency
-// figure the buffer size - this is stupid of course as it should always be 6
-//  but oh well.
-		ipointer = (buffer[4] * 16777216) +
-			(buffer[5] * 65536) +
-			(buffer[6] * 256) +
-			buffer[7];
-		if (ipointer == 6) printf(" Header indicates 6 bytes length, that's good.\n"); else printf(" Header size says %d bytes - bad news, it should be 6.  Continuing anyway.\n",ipointer);
+	for (b = 0; b < 2; b++)
+	{
+		if (posix_memalign((void **)&r.buf[b],IO_ALIGN,window + r.room + IO_ALIGN) != 0)
+		{
+			fprintf(stderr,"Could not allocate %ld bytes for the read buffers!\n",2 * (window + r.room));
+			if (b > 0) free(r.buf[0]);
+			return -1;
+		}
+	}
 
-// Get the MIDI Type
-		newmidi->miditype = buffer[8] * 256 + buffer[9];
-		if (newmidi->miditype <= 2)
-			printf(" MIDI file says it is type %hd\n",newmidi->miditype);
+	r.uring = uring_init(&r.ring,IO_DEPTH) == 0;
+	if (!r.uring)
+		log_msg(LOG_SUMMARY,"INFO: io_uring isn't available, reading with pread\n");
+#ifdef O_DIRECT
+	if (direct_io)
+	{
+		if (fcntl(fd,F_SETFL,fcntl(fd,F_GETFL) | O_DIRECT) == 0)
+			r.direct = 1;
 		else
-			printf(" MIDI file is type %hd (should be 0-2).  Continuing anyway.\n",newmidi->miditype);
+			log_msg(LOG_SUMMARY,"INFO: O_DIRECT isn't supported here, reading through the page cache\n");
+	}
+#endif
+	log_msg(LOG_SUMMARY,"INFO: Streaming with two %ld MB buffers, %s%s\n",r.room / (1024 * 1024),
+		r.uring ? "io_uring" : "pread",r.direct ? ", O_DIRECT" : "");
 
-// Get the number of tracks
-		newmidi->numtracks = buffer[10] * 256 + buffer[11];
-		printf(" MIDI says there should be %hd tracks here.\n",newmidi->numtracks);
+	// O_DIRECT reads start on a block boundary
+	off = r.direct ? start / IO_ALIGN * IO_ALIGN : start;
+	memset(&blk,0,sizeof(blk));
+	blk.img = img;
+	i = start - off;
+	blk.indexed = i;
+	reader_fill(&r,cur,off);
 
-		if (newmidi->miditype == 0 && newmidi->numtracks != 1)
-		{
-			printf(" NOTE that type 0 should have only 1 track...?  Altering type to Type 1.\n");
-			newmidi->miditype=1;
-		}
+	while (1)
+	{
+		reader_wait(&r,cur);
+		blk.data = &r.buf[cur][window - carry];
+		blk.base = r.off[cur] - carry;
+		blk.avail = carry + r.len[cur];
+		eof = r.failed || r.len[cur] < r.room || r.off[cur] + r.len[cur] >= r.size;
+		if (!eof)
+			reader_fill(&r,!cur,r.off[cur] + r.len[cur]);
 
-// Get the timecode.  This can't really be verified.
-		newmidi->timecode = buffer[12] * 256 + buffer[13];
-		printf(" MIDI timecode:  %hd\n",newmidi->timecode);
+		index_block(&blk);
+		limit = eof ? blk.avail : blk.avail - (long)window;
+		i = carve_block(&blk,i,limit);
+		writer_flush(writer);
+		if (eof) break;
+
+		// the unscanned tail goes in front of the next buffer's data
+		carry = blk.avail - i;
+		memcpy(&r.buf[!cur][window - carry],&blk.data[i],carry);
+		block_shift(&blk,i);
+		i = 0;
+		cur = !cur;
 	}
-	return newmidi;
+
+	if (r.uring)
+		uring_free(&r.ring);
+	index_free(&blk.thd);
+	index_free(&blk.trk);
+	free(r.buf[0]);
+	free(r.buf[1]);
+	return r.failed ? -1 : 0;
 }
 
-// Extracts an MTrk (MIDI Track) from a block.
-//  Returns: a new malloc'd mtrk struct containing a proper, repaired, mtrk.
-struct mtrk *extract_mtrk(unsigned char *buffer)
+// Closes an image's input: every segment of a split image.  For a
+//  compressed image that means waiting for its decompressor: -1 if that
+//  failed, so the data ended early.
+int image_close(struct image *img)
 {
-	struct mtrk* newtrack = NULL;
-	unsigned int ptr=0;
+	int k;
 
-// This is the "end of track" command
-	unsigned char end_of_track[]={0x00,0xFF,0x2F,0x00};
+	if (img->segs != NULL)
+	{
+		for (k = 0; k < img->nsegs; k++)
+			close(img->segs[k].fd);
+		return 0;
+	}
+	if (img->codec == NULL)
+		return close(img->fd);
+	if (decomp_finish(img->fd,img->decomp) == 0)
+		return 0;
+	fprintf(stderr,"Decompressing %s with %s failed; it was carved only as far as it got.\n",img->path,img->codec->name);
+	return -1;
+}
 
-	if (strncmp((char *)buffer,"MTrk",4) != 0)
+// Carves one image into its output directory: opens it, picks up its
+//  checkpoint if resuming, then maps or streams it.  Sets and returns
+//  img->ret.
+int carve_image(struct image *img)
+{
+	struct stat st;
+	struct block blk;
+	char path[1000],*base;
+	long mlen=-1,slice,i;
+	int fd,resumed=0;
+
+// does a mkdir so we have somewhere to dump output files; a batch gets a
+//  directory per image inside it (dirname and basename may modify their
+//  argument, so hand them a copy)
+	strncpy(path,img->path,sizeof(path)-1);
+	path[sizeof(path)-1] = '\0';
+	snprintf(img->out_dir,sizeof(img->out_dir),"%s/mcut-out/",dirname(path));
+	mkdir(img->out_dir,S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+	if (batch)
 	{
-		printf(" Expected MTrk for track, but couldn't find it!\n");
-		return NULL;
+		strncpy(path,img->path,sizeof(path)-1);
+		base = strcmp(img->path,"-") == 0 ? "stdin" : basename(path);
+		strncat(img->out_dir,base,sizeof(img->out_dir) - strlen(img->out_dir) - 2);
+		strcat(img->out_dir,"/");
+		mkdir(img->out_dir,S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+	}
+
+// Open the binary blob for reading; "-" is stdin, which may be a pipe.
+//  A device has no st_size, but can be sought to its end; a pipe can't,
+//  and its size stays unknown (-1) until it runs out.
+//  The first of a split image's segments opens them all.
+	if (segment_first(img->path))
+	{
+		if (open_segments(img) != 0 || fstat(img->fd,&st) != 0)
+		{
+			image_close(img);
+			return img->ret = -1;
+		}
 	} else {
-//		printf(" Found MTrk tag for MIDI track\n");
+		img->fd = strcmp(img->path,"-") == 0 ? STDIN_FILENO : open(img->path,O_RDONLY);
+		if (img->fd < 0 || fstat(img->fd,&st) != 0)
+		{
+			fprintf(stderr,"Could not open %s!\n",img->path);
+			if (img->fd >= 0) close(img->fd);
+			return img->ret = -1;
+		}
+		if (S_ISREG(st.st_mode))
+			img->size = st.st_size;
+		else if ((img->size = lseek(img->fd,0,SEEK_END)) < 0 || lseek(img->fd,0,SEEK_SET) != 0)
+			img->size = -1;
+	}
 
-		newtrack = malloc(sizeof(struct mtrk));
-		newtrack->next = NULL;
+	// a compressed image is carved from its decompressor's output, which
+	//  is a pipe like any other; offsets are into the decompressed data
+	if (decompress && img->nsegs == 0 && S_ISREG(st.st_mode) && (img->codec = decomp_detect(img->fd)) != NULL)
+	{
+		fd = decomp_start(img->codec,img->fd,&img->decomp);
+		close(img->fd);
+		img->fd = fd;
+		if (fd < 0)
+		{
+			fprintf(stderr,"Could not start decompressing %s!\n",img->path);
+			return img->ret = -1;
+		}
+		img->size = -1;
+	}
 
-		newtrack->size = ((unsigned int)buffer[4] * 16777216) +
-			((unsigned int)buffer[5] * 65536) +
-			((unsigned int)buffer[6] * 256) +
-			(unsigned int)buffer[7];
-	
-		printf(" MTrk is %d bytes long\n",newtrack->size);
+	// a batch resumes the images that have a checkpoint and starts the
+	//  rest over; those that finished left one at their end
+	if (resume && checkpoint_load(img,&img->start,&mlen) == 0)
+		resumed = 1;
+	else if (resume && !batch)
+	{
+		image_close(img);
+		return img->ret = -1;
+	} else {
+		img->start = 0;
+		mlen = -1;
+	}
 
-		// ipointer should now point to
-		//  an "end of track" marker
-		if (memcmp(&buffer[newtrack->size+0x04],end_of_track,4) != 0) {
-			if (memcmp(&buffer[newtrack->size+0x05],&end_of_track[1],3) != 0) {
-				printf("  Expected end-of-track but couldn't find it!\n  Instead I got: 0x%02x 0x%02x 0x%02x 0x%02x\n",buffer[newtrack->size+0x04],buffer[newtrack->size+0x04+1],buffer[newtrack->size+0x04+2],buffer[newtrack->size+0x04+3]);
-				printf("  Sometimes this indicates the song has been overwritten.  I'll try to backtrack.\n");
-				for (ptr = newtrack->size+0x04; ptr > 8; ptr--)
-				{
-					if (strncmp((char *)&buffer[ptr],"MThd",4) == 0)
-					{
-						printf("  Yes, looks like song was saved over.  Terminating and splitting here (%u -> %u).\n",newtrack->size,ptr);
-						newtrack->size = ptr-0x08;
-						newtrack->data = malloc(ptr + 0x04);
-						memcpy(newtrack->data,&buffer[8],ptr);
-						memcpy(&newtrack->data[ptr],end_of_track,4);
-						newtrack->size += 0x04;
-						newtrack->extratrunc = 1;
-						break;
-					}
-				}
-				if (ptr == 8)
-				{
-					printf("  Nope, file was simply damaged.  I'll just try to append a terminator and hope for the best.\n");
-					newtrack->data = malloc(newtrack->size + 0x04);
-					memcpy(newtrack->data,&buffer[8],newtrack->size);
-					memcpy(&newtrack->data[newtrack->size],end_of_track,4);
-					newtrack->size += 0x04;
-					newtrack->extratrunc = 1;
-				}
-/*				printf("  I'll try rewinding the stream to look for it.\n");
-				for (ptr = newtrack->size+0x04; ptr > 0; ptr--)
-				{
-					if (memcmp(&buffer[1+ptr],&end_of_track[1],3) == 0) {
-						printf("  Got it.  MTrk length should be %d instead\n",ptr+3);
-						if (strncmp((char *)&buffer[4+ptr],"MTrk",4) == 0) {
-							printf("   This is a good match, it's followed immediately by MTrk.\n");
-						}
-					break;
-					}
-				}
-				printf("  I'll try advancing the stream to look for it.\n");
-				for (ptr = newtrack->size+0x05; ; ptr++)
-				{
-					if (memcmp(&buffer[1+ptr],&end_of_track[1],3) == 0) {
-						printf("  Got it.  MTrk length should be %d instead\n",ptr+3);
-						break;
-					} else if (strncmp((char *)&buffer[ptr],"MTrk",4) == 0 || strncmp((char *)&buffer[ptr],"MThd",4) == 0) {
-						printf("  Bummer, I hit another track (or song).\n  I'll just terminate this one correctly and hope for the best.\n");
-						break;
-					}
-				} */
-			} else {
-				printf("  Got partial (0xff2f00) end-of-track, it's unusual but OK\n");
-				newtrack->data = malloc(newtrack->size);
-				memcpy(newtrack->data,&buffer[8],newtrack->size);
-				newtrack->extratrunc = 0;
+	if (manifest_path != NULL)
+	{
+		if (batch)
+			snprintf(path,sizeof(path),"%s/%s",img->out_dir,MANIFEST_PART);
+		else
+			snprintf(path,sizeof(path),"%s",manifest_path);
+
+		// on resume, drop records written after the checkpoint and add on
+		if (mlen >= 0 && (img->manifest = fopen(path,"r+")) != NULL)
+		{
+			if (ftruncate(fileno(img->manifest),mlen) != 0 || fseek(img->manifest,mlen,SEEK_SET) != 0)
+			{
+				fclose(img->manifest);
+				img->manifest = NULL;
 			}
-		} else {
-			printf("  Got complete end-of-track, seems consistent enough...\n");
-			newtrack->data = malloc(newtrack->size);
-			memcpy(newtrack->data,&buffer[8],newtrack->size);
-			newtrack->extratrunc = 0;
+		} else
+			img->manifest = fopen(path,"w");
+		if (img->manifest == NULL)
+		{
+			fprintf(stderr,"Could not open %s for the manifest!\n",path);
+			image_close(img);
+			return img->ret = -1;
 		}
+		if (manifest_csv && !batch && ftell(img->manifest) == 0)
+			fprintf(img->manifest,"%s\n",MANIFEST_HEADER);
 	}
-	return newtrack;
+
+	log_msg(LOG_SUMMARY,"INFO: Opened %s for reading\n",img->path);
+	if (img->codec != NULL)
+		log_msg(LOG_SUMMARY,"INFO: File is %s compressed, decompressing it as it's streamed with a %lu MB window\n",
+			img->codec->name,window / (1024 * 1024));
+	else if (img->nsegs > 0)
+		log_msg(LOG_SUMMARY,"INFO: Joined %d segments, %ld bytes long in all\n",img->nsegs,img->size);
+	else if (img->size >= 0)
+		log_msg(LOG_SUMMARY,"INFO: File is %ld bytes long\n",img->size);
+	else
+		log_msg(LOG_SUMMARY,"INFO: Input is a pipe, streaming it with a %lu MB window\n",window / (1024 * 1024));
+	if (resumed)
+		log_msg(LOG_SUMMARY,"INFO: Resuming at %ld, after %lu files\n",img->start,img->files_written + img->files_duplicate);
+	img->checkpoint_next = time(NULL) + checkpoint_every;
+	atomic_store(&img->from,img->start);
+	atomic_store(&img->indexed,img->start);
+	atomic_store(&img->offset,img->start);
+
+	map_holes(img);
+	if (img->nholes > 0)
+		log_msg(LOG_SUMMARY,"INFO: Image is sparse, %ld holes\n",img->nholes);
+
+	if (stream || img->codec != NULL || !S_ISREG(st.st_mode))
+		img->mapped = NULL;
+	else if (img->nsegs > 0)
+	{
+		img->mapped = map_segments(img);
+		if (img->mapped == NULL)
+			log_msg(LOG_SUMMARY,"INFO: Segments can't be mapped side by side (not whole pages), streaming them\n");
+	} else
+		img->mapped = map_image(img->fd,img->size);
+	if (img->mapped != NULL)
+	{
+		log_msg(LOG_SUMMARY,"INFO: Mapped file into memory.\n");
+		image_close(img);
+
+		// a slice at a time, as stream mode does a buffer at a time:
+		//  everything but the last window is carved, and the next slice
+		//  picks up from there
+		slice = MAP_SLICE;
+		if (pool != NULL && slice < 4 * chunk_size * pool->nthreads)
+			slice = 4 * chunk_size * pool->nthreads;
+		memset(&blk,0,sizeof(blk));
+		blk.img = img;
+		blk.data = img->mapped;
+		blk.indexed = img->start;
+		i = img->start;
+		do
+		{
+			blk.avail = img->size - i > slice + (long)window ? i + slice + (long)window : img->size;
+			index_block(&blk);
+			i = carve_block(&blk,i,blk.avail < img->size ? blk.avail - (long)window : img->size);
+		} while (blk.avail < img->size);
+		log_msg(LOG_SUMMARY,"INFO: Indexed %ld MThd and %ld MTrk tags\n",blk.thd.n,blk.trk.n);
+		writer_flush(writer);
+
+		index_free(&blk.thd);
+		index_free(&blk.trk);
+		munmap(img->mapped,img->size);
+		img->mapped = NULL;
+	} else {
+		if (use_uring && img->size < 0)
+			log_msg(LOG_SUMMARY,"INFO: Can't read a pipe at an offset, streaming it with read\n");
+		else if (use_uring && img->nsegs > 0)
+			log_msg(LOG_SUMMARY,"INFO: --uring reads a single file, streaming the segments with pread\n");
+		if (use_uring && img->size >= 0 && img->nsegs == 0)
+			img->ret = carve_uring(img);
+		else
+			img->ret = carve_stream(img);
+		if (image_close(img) != 0)
+			img->ret = -1;
+	}
+
+	// until the whole batch is done, a finished image checkpoints its end
+	//  so that --resume passes over it
+	if (batch && img->ret == 0 && checkpoint_every > 0)
+		checkpoint_write(img,img->size);
+	if (batch)
+		log_msg(LOG_SUMMARY,"INFO: Finished %s: %lu MIDI files, %lu duplicates, %lu failed\n",
+			img->path,img->files_written,img->files_duplicate,img->files_failed);
+	return img->ret;
 }
 
-// Function for "smart extract" of series of MTrks.
-//  Given a mthd struct, fills the linked list.
-unsigned int smart_extract(struct mthd* midi, unsigned char *buffer,unsigned long eof_point, unsigned long max_distance, unsigned long offset)
+// Batch driver: carves images, taking the next one not yet started, until
+//  there are none left.  Their chunks all go to the one pool.
+static atomic_int next_image;
+
+void *image_main(void *arg)
 {
-	long int i=0,j;
-	unsigned short int curtrack=0;
-	unsigned char in_mthd = 1,lost_sync=0;
+	int k;
 
-	char output_filename[1000];
+	(void)arg;
+	while ((k = atomic_fetch_add(&next_image,1)) < nimages)
+		carve_image(&images[k]);
+	return NULL;
+}
 
-	struct mtrk *newtrack, *track=NULL;
+// Joins the images' manifest parts into manifest_path, in input order,
+//  under one header.  Returns 0 if every part was copied.
+int manifest_join(void)
+{
+	char path[1040],buf[65536];
+	FILE *out,*in;
+	size_t n;
+	int k,ret=0;
 
-	while (in_mthd)
+	out = fopen(manifest_path,"w");
+	if (out == NULL)
+	{
+		fprintf(stderr,"Could not open %s for the manifest!\n",manifest_path);
+		return -1;
+	}
+	if (manifest_csv)
+		fprintf(out,"%s,image\n",MANIFEST_HEADER);
+	for (k = 0; k < nimages; k++)
 	{
-		if (strncmp((char *)&buffer[i],"MThd",4) == 0)
+		if (images[k].manifest == NULL) continue;
+		fclose(images[k].manifest);
+		images[k].manifest = NULL;
+
+		snprintf(path,sizeof(path),"%s/%s",images[k].out_dir,MANIFEST_PART);
+		in = fopen(path,"r");
+		if (in == NULL)
 		{
-			printf(" Collision with another MIDI, we came up short in tracks (expected %hu, got %hu).\n",midi->numtracks,curtrack);
-			midi->numtracks = curtrack;
-			midi->is_damaged = 1;
-			in_mthd = 0;
-		} else if (strncmp((char *)&buffer[i],"MTrk",4) != 0)
+			ret = -1;
+			continue;
+		}
+		while ((n = fread(buf,1,sizeof(buf),in)) > 0)
+			if (fwrite(buf,1,n,out) != n) ret = -1;
+		fclose(in);
+	}
+	if (fclose(out) != 0) ret = -1;
+	return ret;
+}
+
+// How many bytes there are to carve in the image at path, for the
+//  progress report; -1 if there's no telling before it's read (a pipe, a
+//  device, or a compressed image).
+long image_size_hint(const char *path)
+{
+	char name[1040];
+	struct stat st;
+	long total=0,n;
+	int fd,stem,width;
+
+	if (segment_first(path))
+	{
+		for (n = segment_number(path,&stem,&width);; n++)
 		{
-			printf(" Missing MTrk tag for track %hd, this indicates a damaged MIDI file.\n  Starting recovery search.\n",curtrack);
-			midi->is_damaged = 1;
+			segment_path(name,sizeof(name),path,stem,width,n);
+			if (stat(name,&st) != 0) break;
+			total += st.st_size;
+		}
+		return total;
+	}
 
-			lost_sync = 1;
-			// Recovery search.  Look from here to end of file, max distance, and don't look into other MIDIs : )
-			for (j=1; j<eof_point && j<max_distance && strncmp((char *)&buffer[i+j],"MThd",4) != 0; j++)
-			{
-				if (strncmp((char *)&buffer[i+j],"MTrk",4) == 0)
-				{
-					printf(" Found an MTrk tag at point %ld.  %ld bytes were lost, but at least we regained sync.\n",i+j,j);
-					i += j;
-					lost_sync=0;
-					break;
-				}
-			}
-			if (lost_sync)
-			{
-				printf(" Recovery search exceeded EOF or max_distance, or entered another MIDI header.  Truncating MIDI file here.\n");
-				midi->numtracks = curtrack;
-				in_mthd = 0;
-			}
-		} else {
-			printf(" Found MTrk for track %hd\n",curtrack);
-			newtrack = extract_mtrk(&buffer[i]);
+	fd = strcmp(path,"-") == 0 ? dup(STDIN_FILENO) : open(path,O_RDONLY);
+	if (fd < 0) return -1;
+	if (fstat(fd,&st) != 0 || !S_ISREG(st.st_mode) || (decompress && decomp_detect(fd) != NULL))
+		total = -1;
+	else
+		total = st.st_size;
+	close(fd);
+	return total;
+}
 
-			i+=(newtrack->size+0x08);
-			if (newtrack->extratrunc) i -= 0x04;
-			if (midi->track0 == NULL)
-			{
-				midi->track0 = newtrack;
-			} else {
-				track->next=newtrack;
-			}
-			track=newtrack;
+// Is path one of the later segments of the split image first begins?
+int segment_of(const char *path, const char *first)
+{
+	int stem,width,fstem,fwidth;
+	long n = segment_number(path,&stem,&width),f = segment_number(first,&fstem,&fwidth);
 
-			curtrack ++;
-			if (curtrack >= midi->numtracks)
+	return f >= 0 && n > f && stem == fstem && width == fwidth &&
+		strncmp(path,first,stem) == 0 && segment_first(first);
+}
+
+// Adds the images in a list file, one path per line, to images[].
+int read_list(const char *list, int *cap)
+{
+	char line[1000];
+	size_t len;
+	FILE *f;
+
+	f = strcmp(list,"-") == 0 ? stdin : fopen(list,"r");
+	if (f == NULL)
+	{
+		fprintf(stderr,"Could not open %s!\n",list);
+		return -1;
+	}
+	while (fgets(line,sizeof(line),f) != NULL)
+	{
+		len = strcspn(line,"\r\n");
+		line[len] = '\0';
+		if (len == 0) continue;
+
+		if (nimages == *cap)
+		{
+			*cap = *cap ? *cap * 2 : 16;
+			images = realloc(images,*cap * sizeof(struct image));
+			if (images == NULL)
 			{
-				in_mthd = 0;
+				fprintf(stderr,"Out of memory reading %s!\n",list);
+				exit(-1);
 			}
 		}
+		memset(&images[nimages],0,sizeof(struct image));
+		images[nimages].path = strdup(line);
+		images[nimages].fd = -1;
+		nimages++;
 	}
+	if (f != stdin)
+		fclose(f);
+	return 0;
+}
 
-	if (midi->is_generated == 1)
-		sprintf(output_filename,"%s/mc-%08ld-ORPH.mid",out_dir,offset);
-	else if (midi->is_damaged == 0)
-		sprintf(output_filename,"%s/mc-%08ld-OK.mid",out_dir,offset);
-	else
-		sprintf(output_filename,"%s/mc-%08ld-BAD.mid",out_dir,offset);
-	write_midi(midi,output_filename);
-
-	return i;
+void usage(const char *name)
+{
+	fprintf(stderr,"Usage: %s [options] <binfile.img>...\n"
+		"  An image of - is read from stdin, which may be a pipe: it is streamed\n"
+		"  through the window, and --resume reads up to the checkpoint and\n"
+		"  discards it.  Output goes to ./mcut-out/\n"
+		"  A gzip, zstd, xz or bzip2 image is decompressed as it is read, by the\n"
+		"  system's decompressor in another process; offsets in file names and\n"
+		"  the manifest are into the decompressed data\n"
+		"  A split image (name.001, name.002, ...) is named by its first segment\n"
+		"  and carved as one image, with offsets into the segments joined end\n"
+		"  to end; later segments given as well are folded into it.  Only three\n"
+		"  or more zero-padded digits count (.000 or .001 to start)\n"
+		"  -l, --list=FILE       carve the images named in FILE, one per line, as\n"
+		"                        well as any given on the command line\n"
+		"  -J, --images=N        with more than one image, carve this many at once\n"
+		"                        through the shared threads (default %d); each gets\n"
+		"                        mcut-out/<image name>/ and its own checkpoint\n"
+		"  -s, --stream          read the image in chunks instead of mapping it\n"
+		"  -m, --max-memory=MB   buffer size for stream mode, per image being\n"
+		"                        carved (default %d)\n"
+		"      --uring           stream with io_uring, %d reads of %ld KB in flight,\n"
+		"                        into two buffers so one is read while the other\n"
+		"                        is carved; pread where io_uring isn't available\n"
+		"      --direct          with --uring, bypass the page cache (O_DIRECT)\n"
+		"  -w, --window=MB       largest MIDI to reconstruct; also the carry-over\n"
+		"                        between stream chunks (default %d)\n"
+		"  -j, --jobs=N          worker threads (default: one per core)\n"
+		"  -c, --chunk=KB        bytes per worker task (default %d)\n"
+		"  -q, --queue=N         MIDIs that may wait for the writer thread; 0 writes\n"
+		"                        from the carving thread (default %d)\n"
+		"      --min-score=N     ignore orphan MTrks whose events score below N out\n"
+		"                        of 100; 0 keeps them all (default %d)\n"
+		"  -L, --log-level=N     0 silent, 1 summary, 2 each file written, 3 each\n"
+		"                        header and track (default %d).  With more than one\n"
+		"                        job, level 3 also traces speculative carves and\n"
+		"                        lines from different chunks interleave; use -j 1\n"
+		"                        for a readable trace\n"
+		"  -v, --verbose         same as --log-level=3\n"
+		"  -M, --manifest=FILE   write a record for each MIDI to FILE: CSV if its\n"
+		"                        name ends in .csv, JSON Lines otherwise.  With\n"
+		"                        more than one image, records are in input order\n"
+		"                        and end with the image they came from\n"
+		"  -D, --keep-duplicates write every MIDI found, even one identical to a\n"
+		"                        MIDI already written from the same image (by\n"
+		"                        default it is only listed in the manifest,\n"
+		"                        pointing at the first)\n"
+		"      --checkpoint=SEC  save progress to mcut-out/" CHECKPOINT_NAME " this often;\n"
+		"                        0 turns it off (default %d)\n"
+		"      --resume          carry on from the checkpoint of a run that was\n"
+		"                        killed, with the same options\n"
+		"      --no-decompress   carve compressed images as they are\n"
+		"      --no-split        carve each segment of a split image on its own\n"
+		"  -p, --progress=SEC    report offset, speed, files and ETA to stderr\n"
+		"                        this often\n"
+		"      --stats=FILE      keep FILE up to date with the same figures as\n"
+		"                        JSON instead (every %d seconds unless -p)\n",
+		name,DEFAULT_IMAGES,DEFAULT_MAX_MEMORY,IO_DEPTH,IO_CHUNK / 1024,DEFAULT_WINDOW,DEFAULT_CHUNK,DEFAULT_QUEUE,DEFAULT_MIN_SCORE,LOG_FILE,DEFAULT_CHECKPOINT,DEFAULT_PROGRESS);
 }
 
 int main(int argc, char *argv[])
 {
 // C89 requires defines at top of file
-	FILE *binfile;
-	long filesize,i=0,j;
-	short miditype,numtracks,curtrack;
-	int ipointer;
-	unsigned char *buffer;
+	int c,ret=0,jobs,queue=DEFAULT_QUEUE,drivers=DEFAULT_IMAGES,cap=0,i,j,k;
+	struct rusage ru;
+	unsigned long written=0,duplicate=0,failed=0;
+	long total=0,size;
+	char path[1040];
+	const char *ext;
+	int *into;
+	pthread_t *threads;
 
-	struct mthd *midi;
-	struct mtrk *track, *newtrack;
+	static struct option long_options[] = {
+		{"list",required_argument,NULL,'l'},
+		{"images",required_argument,NULL,'J'},
+		{"stream",no_argument,NULL,'s'},
+		{"max-memory",required_argument,NULL,'m'},
+		{"uring",no_argument,NULL,'U'},
+		{"direct",no_argument,NULL,'O'},
+		{"window",required_argument,NULL,'w'},
+		{"jobs",required_argument,NULL,'j'},
+		{"chunk",required_argument,NULL,'c'},
+		{"queue",required_argument,NULL,'q'},
+		{"min-score",required_argument,NULL,'S'},
+		{"log-level",required_argument,NULL,'L'},
+		{"verbose",no_argument,NULL,'v'},
+		{"manifest",required_argument,NULL,'M'},
+		{"keep-duplicates",no_argument,NULL,'D'},
+		{"checkpoint",required_argument,NULL,'C'},
+		{"resume",no_argument,NULL,'R'},
+		{"no-decompress",no_argument,NULL,'Z'},
+		{"no-split",no_argument,NULL,'N'},
+		{"progress",required_argument,NULL,'p'},
+		{"stats",required_argument,NULL,'T'},
+		{NULL,0,NULL,0}
+	};
+
+	jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while ((c = getopt_long(argc,argv,"l:J:sm:w:j:c:q:L:vM:Dp:",long_options,NULL)) != -1)
+	{
+		switch (c)
+		{
+			case 'l':
+				if (read_list(optarg,&cap) != 0)
+					return -1;
+				break;
+			case 'J':
+				drivers = atoi(optarg);
+				break;
+			case 's':
+				stream = 1;
+				break;
+			case 'm':
+				max_memory = strtoul(optarg,NULL,10) * 1024UL * 1024UL;
+				break;
+			case 'U':
+				use_uring = 1;
+				stream = 1;
+				break;
+			case 'O':
+				direct_io = 1;
+				break;
+			case 'w':
+				window = strtoul(optarg,NULL,10) * 1024UL * 1024UL;
+				break;
+			case 'j':
+				jobs = atoi(optarg);
+				break;
+			case 'c':
+				chunk_size = strtol(optarg,NULL,10) * 1024L;
+				break;
+			case 'q':
+				queue = atoi(optarg);
+				break;
+			case 'S':
+				min_score = atoi(optarg);
+				break;
+			case 'L':
+				log_level = atoi(optarg);
+				break;
+			case 'v':
+				log_level = LOG_TRACK;
+				break;
+			case 'M':
+				manifest_path = optarg;
+				break;
+			case 'D':
+				keep_duplicates = 1;
+				break;
+			case 'C':
+				checkpoint_every = atoi(optarg);
+				break;
+			case 'R':
+				resume = 1;
+				break;
+			case 'Z':
+				decompress = 0;
+				break;
+			case 'N':
+				join_segments = 0;
+				break;
+			case 'p':
+				progress.every = atoi(optarg);
+				break;
+			case 'T':
+				progress.stats_path = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return 0;
+		}
+	}
 
-// Some flags for recovery features
-	int in_mthd=0;
+	for (; optind < argc; optind++)
+	{
+		if (nimages == cap)
+		{
+			cap = cap ? cap * 2 : 16;
+			images = realloc(images,cap * sizeof(struct image));
+			if (images == NULL)
+			{
+				fprintf(stderr,"Out of memory!\n");
+				return -1;
+			}
+		}
+		memset(&images[nimages],0,sizeof(struct image));
+		images[nimages].path = strdup(argv[optind]);
+		images[nimages].fd = -1;
+		nimages++;
+	}
 
-	printf("*************************************************************\n******** MIDI CARVER - Greg Kennedy 2010\n");
-	if (argc != 2)
+	if (nimages == 0 || window == 0 || chunk_size <= 0 || drivers <= 0)
 	{
-		fprintf(stderr,"Usage: %s <binfile.img>\n",argv[0]);
+		usage(argv[0]);
 		return 0;
 	}
 
-// does a mkdir so we have somewhere to dump output files
-	strcpy(out_dir,dirname(argv[1]));
-	strcat(out_dir,"/mcut-out/");
-	mkdir(out_dir,S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+	log_msg(LOG_SUMMARY,"*************************************************************\n******** MIDI CARVER - Greg Kennedy 2010\n");
 
-// Open the binary blob for reading.
-	binfile = fopen(argv[1],"rb");
-	if (binfile == NULL)
+	// a split image is named by its first segment; the others (as from
+	//  name.0*) are part of it, not images of their own.  into[k] is 1 +
+	//  the image that image k is part of, or 0.
+	into = calloc(nimages,sizeof(int));
+	for (k = 0; k < nimages && into != NULL; k++)
+		for (i = 0; i < nimages && into[k] == 0; i++)
+			if (i != k && segment_of(images[k].path,images[i].path))
+				into[k] = i + 1;
+	for (j = k = 0; k < nimages; k++)
 	{
-		fprintf(stderr,"Could not open %s!\n",argv[1]);
-		return -1;
+		if (into != NULL && into[k] != 0)
+		{
+			log_msg(LOG_SUMMARY,"INFO: %s is a segment of %s, carving it as part of that\n",images[k].path,images[into[k] - 1].path);
+			continue;
+		}
+		images[j++] = images[k];
 	}
+	// paths go once they've all been compared and logged
+	for (k = 0; k < nimages; k++)
+		if (into != NULL && into[k] != 0)
+			free((char *)images[k].path);
+	nimages = j;
+	free(into);
+	batch = nimages > 1;
 
-	printf("INFO: Opened %s for reading\n",argv[1]);
-	fseek(binfile,0,SEEK_END);
-	filesize = ftell(binfile);
-	printf("INFO: File is %ld bytes long\n",filesize);
-	buffer = malloc(filesize);
+	if (manifest_path != NULL)
+	{
+		ext = strrchr(manifest_path,'.');
+		manifest_csv = (ext != NULL && strcasecmp(ext,".csv") == 0);
+	}
 
-	printf("INFO: Reading entire file into RAM...");
-	fseek(binfile,0,SEEK_SET);
-	fread(buffer,filesize,1,binfile);
-	printf("done!\n");
-	fclose(binfile);
+	if (log_level > LOG_SILENT)
+		log_start();
+#ifdef CARVER_PROFILE
+	prof_start();
+#endif
 
-	// Start looping through the buffer.
-	while (i < filesize)
+	sig_select();
+	log_msg(LOG_SUMMARY,"INFO: Using the %s signature scanner\n",sig_kernel);
+
+	if (jobs > 1)
 	{
-// MTrk outside of an MThd.
-//   This is an orphan MTrk, which would need a new generic MThd to contain it.
-		if (strncmp(&buffer[i],"MTrk",4) == 0)
-		{
-			printf("**********************\nFound an orphan MIDI Track at %ld, source is maybe fragmented. : (\n", i);
-			printf(" Generating a default type 1 MThd.\n");
-			midi=malloc(sizeof(struct mthd));
-			midi->track0=NULL;
-			midi->miditype=1;
-			midi->timecode=120;
-			midi->numtracks = 0;
-			midi->is_damaged=1;
-			midi->is_generated=1;
-			printf(" Counting MTrks from here to next MThd...");
-			
-			for (j=i; j<filesize-3 && strncmp(&buffer[j],"MThd",4) != 0; j++)
-			{
-				if (strncmp(&buffer[j],"MTrk",4) == 0)
-					midi->numtracks ++;
-			}
-			printf(" found %hd MTrk tags.  Beginning extraction.\n",midi->numtracks);
-			i += smart_extract(midi,&buffer[i],filesize-i,32768,i);
-		} else if (strncmp(&buffer[i],"MThd",4) == 0)
-		{
-			printf("*********************************\nFound a MIDI Header starting at %ld\n",i);
-// Extract the header and advance the buffer pointer.
-			midi = extract_mthd(&buffer[i]);
-			i += 14;
+		pool = pool_create(jobs);
+		log_msg(LOG_SUMMARY,"INFO: Carving with %d threads\n",pool->nthreads);
+	}
+	if (queue > 0)
+		writer = writer_start(queue);
 
-			i += smart_extract(midi,&buffer[i],filesize-i,32768,i-14);
-		} else {
-			++i;
+	// the total size is only for the progress report, so it's taken before
+	//  the images are opened; one image without a size makes it unknown
+	for (k = 0; k < nimages && total >= 0; k++)
+	{
+		size = image_size_hint(images[k].path);
+		total = size >= 0 ? total + size : -1;
+	}
+	if (progress.stats_path != NULL && progress.every <= 0)
+		progress.every = DEFAULT_PROGRESS;
+	progress_start(total);
+
+	if (!batch)
+		carve_image(&images[0]);
+	else {
+		if (drivers > nimages) drivers = nimages;
+		log_msg(LOG_SUMMARY,"INFO: Carving %d images, %d at a time\n",nimages,drivers);
+		threads = calloc(drivers,sizeof(pthread_t));
+		atomic_init(&next_image,0);
+		for (k = 0; k < drivers; k++)
+			if (threads == NULL || pthread_create(&threads[k],NULL,image_main,NULL) != 0)
+				break;
+		// whatever threads couldn't be started, this one makes up for
+		if (k == 0)
+			image_main(NULL);
+		while (k-- > 0)
+			pthread_join(threads[k],NULL);
+		free(threads);
+	}
+
+	if (writer != NULL)
+		writer_stop(writer);
+	if (pool != NULL)
+		pool_destroy(pool);
+	progress_stop();
+
+	for (k = 0; k < nimages; k++)
+	{
+		if (images[k].ret != 0) ret = images[k].ret;
+		written += images[k].files_written;
+		duplicate += images[k].files_duplicate;
+		failed += images[k].files_failed;
+	}
+	if (batch && manifest_path != NULL && manifest_join() != 0)
+	{
+		fprintf(stderr,"Could not join the manifest parts into %s!\n",manifest_path);
+		ret = -1;
+	}
+
+	// finished: there's nothing left to resume.  A batch only lets go of
+	//  its checkpoints and manifest parts once every image is done, so
+	//  --resume can still carry on the ones that weren't.
+	for (k = 0; k < nimages && (ret == 0 || !batch); k++)
+	{
+		if (images[k].ret != 0) continue;
+		snprintf(path,sizeof(path),"%s/%s",images[k].out_dir,CHECKPOINT_NAME);
+		unlink(path);
+		if (batch && manifest_path != NULL)
+		{
+			snprintf(path,sizeof(path),"%s/%s",images[k].out_dir,MANIFEST_PART);
+			unlink(path);
 		}
 	}
-	free(buffer);
-	return 0;
+
+	log_msg(LOG_SUMMARY,"INFO: Skipped %ld bytes of holes and %ld bytes of zeros\n",
+		atomic_load(&skipped_holes),atomic_load(&skipped_zeros));
+	log_msg(LOG_SUMMARY,"INFO: Wrote %lu MIDI files, skipped %lu duplicates, %lu failed\n",written,duplicate,failed);
+	log_msg(LOG_SUMMARY,"INFO: Arenas: %lu carves, %lu nodes (%lu bytes), %lu blocks allocated, %lu arenas, largest carve %lu bytes\n",
+		arena_stats.carves,arena_stats.allocs,arena_stats.bytes,arena_stats.blocks,arena_stats.arenas,arena_stats.peak);
+	if (getrusage(RUSAGE_SELF,&ru) == 0)
+		log_msg(LOG_SUMMARY,"INFO: Peak RSS %ld KB\n",ru.ru_maxrss);
+	log_stop();
+#ifdef CARVER_PROFILE
+	prof_dump();
+#endif
+	for (k = 0; k < nimages; k++)
+	{
+		if (images[k].manifest != NULL)
+			fclose(images[k].manifest);
+		free(images[k].dedup.slot);
+		free(images[k].holes);
+		free(images[k].segs);
+		free((char *)images[k].path);
+	}
+	free(images);
+	arena_cleanup();
+	return ret;
 }
@@ -0,0 +1,122 @@
+// decomp.h - transparent decompression for midi-carver
+//  recognizes a compressed image by its magic number and runs the
+//  system's decompressor on it in a child process, handing back a pipe
+//  of the decompressed bytes
+//
+//  The decompressor runs alongside the scan on its own core, and the
+//  carver needs no compression library: where there's a parallel
+//  decompressor (pigz, lbzip2/pbzip2, xz -T0) it's tried first, then the
+//  ordinary one.  Only gzip, zstd, xz and bzip2 are recognized.
+
+#ifndef DECOMP_H
+#define DECOMP_H
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define DECOMP_MAX_TOOLS 3
+
+struct codec
+{
+	const char *name;
+	const unsigned char *magic;
+	int magic_len;
+	// commands to try in turn, each NULL-terminated
+	const char *tools[DECOMP_MAX_TOOLS][5];
+};
+
+static const struct codec codecs[] = {
+	{ "gzip", (const unsigned char *)"\x1f\x8b\x08", 3,
+		{ { "pigz", "-dc", NULL }, { "gzip", "-dc", NULL } } },
+	{ "zstd", (const unsigned char *)"\x28\xb5\x2f\xfd", 4,
+		{ { "zstd", "-dcq", NULL } } },
+	{ "xz", (const unsigned char *)"\xfd\x37\x7a\x58\x5a\x00", 6,
+		{ { "xz", "-dc", "-T0", NULL }, { "xz", "-dc", NULL } } },
+	{ "bzip2", (const unsigned char *)"BZh", 3,
+		{ { "lbzip2", "-dc", NULL }, { "pbzip2", "-dc", NULL }, { "bzip2", "-dc", NULL } } },
+	{ NULL, NULL, 0, { { NULL } } }
+};
+
+// The codec fd's contents are compressed with, or NULL.  Looks at the
+//  start of the file without moving fd, so a pipe (which can't be read
+//  from without using the bytes up) is never recognized.
+static const struct codec *decomp_detect(int fd)
+{
+	unsigned char head[8];
+	ssize_t got;
+	int k;
+
+	got = pread(fd,head,sizeof(head),0);
+	if (got <= 0) return NULL;
+
+	for (k = 0; codecs[k].name != NULL; k++)
+	{
+		if (got < codecs[k].magic_len || memcmp(head,codecs[k].magic,codecs[k].magic_len) != 0)
+			continue;
+		// bzip2's magic is short; the block size digit after it narrows it down
+		if (strcmp(codecs[k].name,"bzip2") == 0 && (got < 4 || head[3] < '1' || head[3] > '9'))
+			continue;
+		return &codecs[k];
+	}
+	return NULL;
+}
+
+// Starts decompressing fd (which must be at offset 0) with c in a child
+//  process.  Returns the read end of a pipe carrying the decompressed
+//  bytes and sets *pid, or -1.  fd may be closed once this returns.
+static int decomp_start(const struct codec *c, int fd, pid_t *pid)
+{
+	int p[2],k;
+	ssize_t w;
+
+	// close-on-exec, so another image's decompressor can't hold this
+	//  pipe open and keep it from ever reaching its end
+	if (pipe2(p,O_CLOEXEC) != 0) return -1;
+
+	*pid = fork();
+	if (*pid < 0)
+	{
+		close(p[0]);
+		close(p[1]);
+		return -1;
+	}
+	if (*pid == 0)
+	{
+		if (dup2(fd,STDIN_FILENO) < 0 || dup2(p[1],STDOUT_FILENO) < 0)
+			_exit(127);
+		signal(SIGPIPE,SIG_DFL);
+		for (k = 0; k < DECOMP_MAX_TOOLS && c->tools[k][0] != NULL; k++)
+			execvp(c->tools[k][0],(char *const *)c->tools[k]);
+		// no stdio in a forked child of a threaded program
+		w = write(STDERR_FILENO,"No ",3);
+		w = write(STDERR_FILENO,c->name,strlen(c->name));
+		w = write(STDERR_FILENO," decompressor found in PATH.\n",29);
+		(void)w;
+		_exit(127);
+	}
+
+	close(p[1]);
+	return p[0];
+}
+
+// Closes the pipe from decomp_start and waits for the child.  0 if it
+//  decompressed everything cleanly.  Closing first means a child that
+//  still had output to give stops with SIGPIPE instead of hanging.
+static int decomp_finish(int fd, pid_t pid)
+{
+	int status;
+
+	close(fd);
+	while (waitpid(pid,&status,0) < 0)
+		if (errno != EINTR) return -1;
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0) return 0;
+	return -1;
+}
+
+#endif
@@ -0,0 +1,490 @@
+// mkimage.c - test image generator for midi-carver
+//  plants MIDI files, whole and damaged, in filler and writes down where
+//  each one went and what the carver should make of it
+//
+//  Damage follows the cases carver.c's header comment says it handles:
+//   * valid      - a complete type 1 MIDI, carved byte for byte (OK)
+//   * orphan     - MTrks whose MThd is gone; carved under a default
+//                    header (ORPH)
+//   * hole       - an MThd with one of its MTrks missing (BAD)
+//   * truncated  - a MIDI cut off partway through a track (BAD)
+//   * overwritten - a MIDI cut off by the start of another, complete
+//                    one (BAD, then OK)
+//   * badsize    - a track whose length field overstates it, but whose
+//                    events and end-of-track are intact (BAD)
+//   * overrun    - the same, with the overstated length reaching over
+//                    complete MIDIs planted close behind it (BAD, then
+//                    OK for each)
+//
+//  The ground truth goes to <image>.truth as CSV:
+//   offset,kind,status,length,xxh64
+//  length and xxh64 describe the file the carver should write; they are
+//  only given where that file is fully predictable (valid and orphan).
+//
+//  Items are spaced further apart than the carver's resync distance, so
+//  one never bleeds into the next - except where overrun means it to.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <getopt.h>
+
+#include "xxh64.h"
+
+// carver.c gives up a resync search after this many bytes
+#define RESYNC_DISTANCE 32768
+
+// least filler between two planted items
+#define MIN_GAP (RESYNC_DISTANCE + 8192)
+
+#define DEFAULT_SIZE 64
+#define DEFAULT_SEED 1
+
+// the timecode carver.c gives an orphan's generated header
+#define ORPHAN_TIMECODE 120
+
+#define FILL_RANDOM 0
+#define FILL_ZERO 1
+#define FILL_TEXT 2
+
+static FILE *img, *truth;
+static long pos = 0;
+static int fill = FILL_RANDOM;
+
+static unsigned long long rng_state;
+
+// xorshift64*, so images are the same on every platform for a given seed
+unsigned long long rng(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338717ULL;
+}
+
+// uniform in [lo, hi]
+long rng_range(long lo, long hi)
+{
+	return lo + (long)(rng() % (unsigned long long)(hi - lo + 1));
+}
+
+// A growable byte buffer.
+struct bytes
+{
+	unsigned char *p;
+	long n, cap;
+};
+
+void put(struct bytes *b, const void *src, long n)
+{
+	if (b->n + n > b->cap)
+	{
+		b->cap = (b->n + n) * 2;
+		b->p = realloc(b->p,b->cap);
+		if (b->p == NULL)
+		{
+			fprintf(stderr,"Out of memory!\n");
+			exit(1);
+		}
+	}
+	memcpy(&b->p[b->n],src,n);
+	b->n += n;
+}
+
+void put_byte(struct bytes *b, unsigned char c)
+{
+	put(b,&c,1);
+}
+
+void put_be(struct bytes *b, unsigned long v, int n)
+{
+	while (n-- > 0)
+		put_byte(b,(v >> (8 * n)) & 0xFF);
+}
+
+// A track body: a tempo, a program change, then notes with small delta
+//  times, ended with 00 FF 2F 00.  Long enough that an orphan scores well
+//  above the carver's default threshold.
+void make_track(struct bytes *b, int events)
+{
+	int k,note;
+
+	put(b,"\x00\xFF\x51\x03\x07\xA1\x20",7);
+	put_byte(b,0x00);
+	put_byte(b,0xC0);
+	put_byte(b,rng_range(0,127));
+	for (k = 0; k < events; k++)
+	{
+		note = rng_range(36,96);
+		put_byte(b,rng_range(0,0x7F));
+		put_byte(b,0x90);
+		put_byte(b,note);
+		put_byte(b,rng_range(1,127));
+		put_byte(b,rng_range(1,0x7F));
+		put_byte(b,0x80);
+		put_byte(b,note);
+		put_byte(b,0x40);
+	}
+	put(b,"\x00\xFF\x2F\x00",4);
+}
+
+// An MTrk chunk around a fresh track body.
+void make_mtrk(struct bytes *b)
+{
+	struct bytes body = { NULL, 0, 0 };
+
+	make_track(&body,rng_range(20,400));
+	put(b,"MTrk",4);
+	put_be(b,body.n,4);
+	put(b,body.p,body.n);
+	free(body.p);
+}
+
+void make_mthd(struct bytes *b, int type, int ntracks, int timecode)
+{
+	put(b,"MThd",4);
+	put_be(b,6,4);
+	put_be(b,type,2);
+	put_be(b,ntracks,2);
+	put_be(b,timecode,2);
+}
+
+// A complete type 1 MIDI with ntracks tracks.
+void make_midi(struct bytes *b, int ntracks)
+{
+	int k;
+
+	make_mthd(b,1,ntracks,rng_range(48,960));
+	for (k = 0; k < ntracks; k++)
+		make_mtrk(b);
+}
+
+void emit(const void *p, long n)
+{
+	if (n > 0 && fwrite(p,1,n,img) != (size_t)n)
+	{
+		perror("fwrite");
+		exit(1);
+	}
+	pos += n;
+}
+
+// Writes n bytes of filler.
+void emit_filler(long n)
+{
+	static const char text[] = "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do "
+		"eiusmod tempor incididunt ut labore et dolore magna aliqua.\n";
+	unsigned char buf[65536];
+	unsigned long long r;
+	long k,m;
+
+	while (n > 0)
+	{
+		m = n < (long)sizeof(buf) ? n : (long)sizeof(buf);
+		if (fill == FILL_ZERO)
+			memset(buf,0,m);
+		else if (fill == FILL_TEXT)
+		{
+			for (k = 0; k < m; k++)
+				buf[k] = text[(pos + k) % (sizeof(text) - 1)];
+		} else {
+			for (k = 0; k < m; k += 8)
+			{
+				r = rng();
+				memcpy(&buf[k],&r,m - k < 8 ? m - k : 8);
+			}
+		}
+		emit(buf,m);
+		n -= m;
+	}
+}
+
+// Records what the carver should find at offset.  A file the carver
+//  should write byte for byte comes with its length and hash.
+void record(long offset, const char *kind, const char *status, const struct bytes *expect)
+{
+	struct xxh64 h;
+
+	if (expect != NULL)
+	{
+		xxh64_init(&h);
+		xxh64_update(&h,expect->p,expect->n);
+		fprintf(truth,"%ld,%s,%s,%ld,%016llx\n",offset,kind,status,expect->n,xxh64_final(&h));
+	} else
+		fprintf(truth,"%ld,%s,%s,,\n",offset,kind,status);
+}
+
+// Offsets of the MTrk chunks in a MIDI made by make_midi, and where it ends.
+int track_offsets(const struct bytes *b, long *off, int max)
+{
+	long i = 14;
+	int n = 0;
+
+	while (i + 8 <= b->n && n < max)
+	{
+		off[n++] = i;
+		i += 8 + ((long)b->p[i + 4] << 24 | b->p[i + 5] << 16 | b->p[i + 6] << 8 | b->p[i + 7]);
+	}
+	off[n] = i;
+	return n;
+}
+
+void plant_valid(void)
+{
+	struct bytes b = { NULL, 0, 0 };
+
+	make_midi(&b,rng_range(1,8));
+	record(pos,"valid","OK",&b);
+	emit(b.p,b.n);
+	free(b.p);
+}
+
+// The tracks go in as they are; the carver should put a type 1 header
+//  with the track count and its default timecode in front.
+void plant_orphan(void)
+{
+	struct bytes b = { NULL, 0, 0 }, expect = { NULL, 0, 0 };
+	int k,n = rng_range(1,6);
+
+	for (k = 0; k < n; k++)
+		make_mtrk(&b);
+	make_mthd(&expect,1,n,ORPHAN_TIMECODE);
+	put(&expect,b.p,b.n);
+	record(pos,"orphan","ORPH",&expect);
+	emit(b.p,b.n);
+	free(b.p);
+	free(expect.p);
+}
+
+// Drops one track out of the middle and leaves filler in its place.
+void plant_hole(void)
+{
+	struct bytes b = { NULL, 0, 0 };
+	long off[17];
+	int n,k;
+
+	make_midi(&b,rng_range(3,8));
+	n = track_offsets(&b,off,16);
+	k = rng_range(1,n - 2);
+	record(pos,"hole","BAD",NULL);
+	emit(b.p,off[k]);
+	emit_filler(rng_range(16,off[k + 1] - off[k]));
+	emit(&b.p[off[k + 1]],b.n - off[k + 1]);
+	free(b.p);
+}
+
+// Cuts the file off partway through its last track.
+void plant_truncated(void)
+{
+	struct bytes b = { NULL, 0, 0 };
+	long off[17];
+	int n;
+
+	make_midi(&b,rng_range(1,8));
+	n = track_offsets(&b,off,16);
+	record(pos,"truncated","BAD",NULL);
+	emit(b.p,rng_range(off[n - 1] + 16,off[n] - 8));
+	free(b.p);
+}
+
+// Lays a complete MIDI over the tail of another one's last track, as
+//  when a file is saved over a deleted one.
+void plant_overwritten(void)
+{
+	struct bytes a = { NULL, 0, 0 }, b = { NULL, 0, 0 };
+	long off[17];
+	int n;
+
+	make_midi(&a,rng_range(1,8));
+	make_midi(&b,rng_range(1,8));
+	n = track_offsets(&a,off,16);
+	record(pos,"overwritten","BAD",NULL);
+	emit(a.p,rng_range(off[n - 1] + 16,off[n] - 8));
+	record(pos,"valid","OK",&b);
+	emit(b.p,b.n);
+	free(a.p);
+	free(b.p);
+}
+
+// Sets the length field of the MTrk at off to len.
+void set_length(struct bytes *b, long off, long len)
+{
+	b->p[off + 4] = (len >> 24) & 0xFF;
+	b->p[off + 5] = (len >> 16) & 0xFF;
+	b->p[off + 6] = (len >> 8) & 0xFF;
+	b->p[off + 7] = len & 0xFF;
+}
+
+// Overstates one track's length field.  The bogus end stays inside the
+//  gap after the item; overrun is the case where it doesn't.
+void plant_badsize(void)
+{
+	struct bytes b = { NULL, 0, 0 };
+	long off[17];
+	int n,k;
+
+	make_midi(&b,rng_range(1,8));
+	n = track_offsets(&b,off,16);
+	k = rng_range(0,n - 1);
+	set_length(&b,off[k],off[k + 1] - off[k] - 8 + rng_range(1,8192));
+	record(pos,"badsize","BAD",NULL);
+	emit(b.p,b.n);
+	free(b.p);
+}
+
+// Overstates one track's length field so far that it covers the few
+//  complete MIDIs planted a little way after it.  All of them should come
+//  back, not just the one nearest the bogus end.
+void plant_overrun(void)
+{
+	struct bytes a = { NULL, 0, 0 }, b[3];
+	long off[17],gap[3],span = 0;
+	int n,k,m = rng_range(1,3);
+
+	make_midi(&a,rng_range(1,4));
+	for (k = 0; k < m; k++)
+	{
+		memset(&b[k],0,sizeof(b[k]));
+		make_midi(&b[k],rng_range(1,4));
+		gap[k] = rng_range(16,4096);
+		span += gap[k] + b[k].n;
+	}
+	n = track_offsets(&a,off,16);
+	k = rng_range(0,n - 1);
+	set_length(&a,off[k],a.n - off[k] - 8 + span + rng_range(1,8192));
+	record(pos,"overrun","BAD",NULL);
+	emit(a.p,a.n);
+	for (k = 0; k < m; k++)
+	{
+		emit_filler(gap[k]);
+		record(pos,"valid","OK",&b[k]);
+		emit(b[k].p,b[k].n);
+		free(b[k].p);
+	}
+	free(a.p);
+}
+
+void usage(const char *name)
+{
+	fprintf(stderr,"Usage: %s [options] <out.img>\n"
+		"  -s, --size=MB         image size (default %d)\n"
+		"  -n, --count=N         stop after planting N items\n"
+		"  -f, --fill=KIND       filler: random, zero or text (default random)\n"
+		"  -S, --seed=N          random seed (default %d)\n"
+		"  -k, --kinds=LIST      comma-separated kinds to plant (default all):\n"
+		"                        valid,orphan,hole,truncated,overwritten,badsize,\n"
+		"                        overrun\n"
+		"The ground truth is written to <out.img>.truth.\n",
+		name,DEFAULT_SIZE,DEFAULT_SEED);
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *kind_names[] = { "valid","orphan","hole","truncated","overwritten","badsize","overrun" };
+	static void (*kind_plant[])(void) = { plant_valid,plant_orphan,plant_hole,plant_truncated,plant_overwritten,plant_badsize,plant_overrun };
+	// out of 100, in the order above
+	static const int kind_weight[] = { 40,15,10,10,10,10,5 };
+
+	int c,k,nkinds = sizeof(kind_names) / sizeof(kind_names[0]),enabled[7],total,pick;
+	long size = DEFAULT_SIZE * 1024L * 1024L,count = -1,planted = 0;
+	char path[1000],*list = NULL,*tok;
+
+	static struct option long_options[] = {
+		{"size",required_argument,NULL,'s'},
+		{"count",required_argument,NULL,'n'},
+		{"fill",required_argument,NULL,'f'},
+		{"seed",required_argument,NULL,'S'},
+		{"kinds",required_argument,NULL,'k'},
+		{NULL,0,NULL,0}
+	};
+
+	rng_state = DEFAULT_SEED;
+	while ((c = getopt_long(argc,argv,"s:n:f:S:k:",long_options,NULL)) != -1)
+	{
+		switch (c)
+		{
+			case 's':
+				size = strtol(optarg,NULL,10) * 1024L * 1024L;
+				break;
+			case 'n':
+				count = strtol(optarg,NULL,10);
+				break;
+			case 'f':
+				if (strcmp(optarg,"zero") == 0)
+					fill = FILL_ZERO;
+				else if (strcmp(optarg,"text") == 0)
+					fill = FILL_TEXT;
+				else
+					fill = FILL_RANDOM;
+				break;
+			case 'S':
+				rng_state = strtoull(optarg,NULL,10);
+				break;
+			case 'k':
+				list = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (optind != argc - 1 || size <= 0)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	// xorshift never leaves zero
+	if (rng_state == 0) rng_state = DEFAULT_SEED;
+
+	for (k = 0; k < nkinds; k++)
+		enabled[k] = (list == NULL);
+	for (tok = list ? strtok(list,",") : NULL; tok != NULL; tok = strtok(NULL,","))
+	{
+		for (k = 0; k < nkinds; k++)
+			if (strcmp(tok,kind_names[k]) == 0) enabled[k] = 1;
+	}
+	total = 0;
+	for (k = 0; k < nkinds; k++)
+		if (enabled[k]) total += kind_weight[k];
+	if (total == 0)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	img = fopen(argv[optind],"wb");
+	snprintf(path,sizeof(path),"%s.truth",argv[optind]);
+	truth = fopen(path,"w");
+	if (img == NULL || truth == NULL)
+	{
+		fprintf(stderr,"Could not open %s for writing!\n",img == NULL ? argv[optind] : path);
+		return 1;
+	}
+	fprintf(truth,"offset,kind,status,length,xxh64\n");
+
+	emit_filler(rng_range(0,MIN_GAP));
+	// the biggest item is two eight-track MIDIs, or four four-track ones
+	//  and a little filler: well under 64 KB
+	while (pos + 65536 + MIN_GAP <= size && (count < 0 || planted < count))
+	{
+		pick = rng_range(0,total - 1);
+		for (k = 0; k < nkinds; k++)
+		{
+			if (!enabled[k]) continue;
+			if (pick < kind_weight[k]) break;
+			pick -= kind_weight[k];
+		}
+		kind_plant[k]();
+		planted++;
+		emit_filler(rng_range(MIN_GAP,2 * MIN_GAP));
+	}
+	if (pos < size)
+		emit_filler(size - pos);
+
+	fclose(img);
+	fclose(truth);
+	printf("Planted %ld items in %ld bytes of %s filler; ground truth in %s\n",
+		planted,pos,fill == FILL_ZERO ? "zero" : (fill == FILL_TEXT ? "text" : "random"),path);
+	return 0;
+}
@@ -0,0 +1,303 @@
+// sigbench.c - microbenchmark for midi-carver's signature scanner
+//  times the ways of finding "MThd"/"MTrk" in a buffer against each other
+//  across buffer sizes and contents, printing results in the same layout
+//  as Google Benchmark so they can be compared with its tools by eye
+//
+//  Kernels:
+//   * strncmp - the original loop: two strncmp calls at every offset
+//   * memmem  - libc memmem for each tag, keeping the next hit of each
+//   * memchr  - sigscan.h's portable kernel (memchr for 'M', then check)
+//   * sse2, avx2 - sigscan.h's vector kernels, where the CPU has them
+//
+//  Contents:
+//   * random - uniform random bytes; almost no 'M' is followed by "T"
+//   * zero   - all zero bytes, as in unused space on a disk image
+//   * text   - English text, where 'M' is common but "MT" is not
+//   * midi   - nothing but small MIDI files back to back, so a tag every
+//                 few hundred bytes
+//
+//  usage: sigbench [--filter=SUBSTRING] [--min-time=SECONDS]
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <getopt.h>
+
+#include "sigscan.h"
+
+#define DEFAULT_MIN_TIME 0.2
+
+typedef long (*kernel_fn)(const unsigned char *buf, long n);
+
+// Every kernel returns the number of tags in buf, so they can be checked
+//  against each other and none of them can be optimized away.
+
+long count_strncmp(const unsigned char *buf, long n)
+{
+	long i,hits=0;
+
+	for (i = 0; i + 4 <= n; i++)
+	{
+		if (strncmp((const char *)&buf[i],"MTrk",4) == 0)
+			hits++;
+		else if (strncmp((const char *)&buf[i],"MThd",4) == 0)
+			hits++;
+	}
+	return hits;
+}
+
+long count_memmem(const unsigned char *buf, long n)
+{
+	const unsigned char *end = buf + n,*h,*t;
+	long hits=0;
+
+	h = memmem(buf,n,"MThd",4);
+	t = memmem(buf,n,"MTrk",4);
+	while (h != NULL || t != NULL)
+	{
+		hits++;
+		if (t == NULL || (h != NULL && h < t))
+			h = memmem(h + 1,end - h - 1,"MThd",4);
+		else
+			t = memmem(t + 1,end - t - 1,"MTrk",4);
+	}
+	return hits;
+}
+
+// Runs one of sigscan.h's kernels over the whole buffer.
+static inline long count_sig(long (*next)(const unsigned char *, long, long, int *), const unsigned char *buf, long n)
+{
+	long i=0,hits=0;
+	int kind;
+
+	while ((i = next(buf,i,n,&kind)) >= 0)
+	{
+		hits++;
+		i++;
+	}
+	return hits;
+}
+
+long count_memchr(const unsigned char *buf, long n)
+{
+	return count_sig(sig_next_scalar,buf,n);
+}
+
+#ifdef SIGSCAN_X86
+long count_sse2(const unsigned char *buf, long n)
+{
+	return count_sig(sig_next_sse2,buf,n);
+}
+
+long count_avx2(const unsigned char *buf, long n)
+{
+	return count_sig(sig_next_avx2,buf,n);
+}
+#endif
+
+#define NEEDS_NOTHING 0
+#define NEEDS_SSE2 1
+#define NEEDS_AVX2 2
+
+struct kernel
+{
+	const char *name;
+	kernel_fn fn;
+	int needs;	// NEEDS_*
+};
+
+static struct kernel kernels[] = {
+	{ "strncmp", count_strncmp, NEEDS_NOTHING },
+	{ "memmem", count_memmem, NEEDS_NOTHING },
+	{ "memchr", count_memchr, NEEDS_NOTHING },
+#ifdef SIGSCAN_X86
+	{ "sse2", count_sse2, NEEDS_SSE2 },
+	{ "avx2", count_avx2, NEEDS_AVX2 },
+#endif
+	{ NULL, NULL, NEEDS_NOTHING }
+};
+
+// Can this CPU run a kernel that needs the given feature?
+int cpu_has(int needs)
+{
+#ifdef SIGSCAN_X86
+	__builtin_cpu_init();
+	if (needs == NEEDS_SSE2) return __builtin_cpu_supports("sse2");
+	if (needs == NEEDS_AVX2) return __builtin_cpu_supports("avx2");
+#endif
+	return needs == NEEDS_NOTHING;
+}
+
+static const char *contents[] = { "random", "zero", "text", "midi", NULL };
+
+static const long sizes[] = { 4096, 65536, 1048576, 16777216, 0 };
+
+static unsigned long long rng_state = 1;
+
+unsigned long long rng(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338717ULL;
+}
+
+// Fills buf with n bytes of the named kind of content.
+void fill(unsigned char *buf, long n, const char *kind)
+{
+	static const char text[] = "Mary and Tom met at the MTA stop on Main St. in March; "
+		"the song was a MIDI file, Mr. T said, not an MP3. ";
+	long i,k,len;
+
+	if (strcmp(kind,"zero") == 0)
+		memset(buf,0,n);
+	else if (strcmp(kind,"text") == 0)
+	{
+		for (i = 0; i < n; i++)
+			buf[i] = text[i % (sizeof(text) - 1)];
+	} else if (strcmp(kind,"midi") == 0)
+	{
+		// header, one track of notes, end of track; over and over
+		i = 0;
+		while (i < n)
+		{
+			len = 4 + 8 * (16 + rng() % 48) + 4;
+			if (i + 14 + 8 + len > n)
+			{
+				memset(&buf[i],0,n - i);
+				break;
+			}
+			memcpy(&buf[i],"MThd\0\0\0\x06\0\x01\0\x01\0\x60",14);
+			i += 14;
+			memcpy(&buf[i],"MTrk",4);
+			buf[i + 4] = 0;
+			buf[i + 5] = 0;
+			buf[i + 6] = len >> 8;
+			buf[i + 7] = len & 0xFF;
+			i += 8;
+			memcpy(&buf[i],"\0\xC0\x01\0",4);
+			for (k = 4; k < len - 4; k += 8)
+				memcpy(&buf[i + k],"\x10\x90\x3C\x64\x10\x80\x3C\x00",8);
+			memcpy(&buf[i + len - 4],"\0\xFF\x2F\0",4);
+			i += len;
+		}
+	} else {
+		for (i = 0; i < n; i += 8)
+		{
+			unsigned long long r = rng();
+			memcpy(&buf[i],&r,n - i < 8 ? n - i : 8);
+		}
+	}
+}
+
+double now(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock,&ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Prints a byte rate the way Google Benchmark does.
+void print_rate(double per_second, const char *unit)
+{
+	static const char *prefix[] = { "", "k", "M", "G", "T" };
+	int k = 0;
+
+	while (per_second >= 1024 && k < 4)
+	{
+		per_second /= 1024;
+		k++;
+	}
+	printf(" %7.3f%s%s",per_second,prefix[k],unit);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *filter = NULL;
+	double min_time = DEFAULT_MIN_TIME,w0,c0,wall,cpu;
+	unsigned char *buf;
+	long iters,hits,expect,k;
+	int c,s,t,failed=0;
+	char name[80];
+
+	static struct option long_options[] = {
+		{"filter",required_argument,NULL,'f'},
+		{"min-time",required_argument,NULL,'t'},
+		{NULL,0,NULL,0}
+	};
+
+	while ((c = getopt_long(argc,argv,"f:t:",long_options,NULL)) != -1)
+	{
+		switch (c)
+		{
+			case 'f':
+				filter = optarg;
+				break;
+			case 't':
+				min_time = atof(optarg);
+				break;
+			default:
+				fprintf(stderr,"Usage: %s [--filter=SUBSTRING] [--min-time=SECONDS]\n",argv[0]);
+				return 1;
+		}
+	}
+
+	buf = malloc(sizes[sizeof(sizes) / sizeof(sizes[0]) - 2]);
+	if (buf == NULL)
+	{
+		fprintf(stderr,"Out of memory!\n");
+		return 1;
+	}
+
+	printf("-------------------------------------------------------------------------------------------\n");
+	printf("%-32s %13s %13s %12s %15s %12s\n","Benchmark","Time","CPU","Iterations","bytes_per_second","tags");
+	printf("-------------------------------------------------------------------------------------------\n");
+
+	for (t = 0; contents[t] != NULL; t++)
+	{
+		for (s = 0; sizes[s] != 0; s++)
+		{
+			rng_state = 1;
+			fill(buf,sizes[s],contents[t]);
+			expect = count_memchr(buf,sizes[s]);
+
+			for (k = 0; kernels[k].name != NULL; k++)
+			{
+				snprintf(name,sizeof(name),"BM_%s/%s/%ld",kernels[k].name,contents[t],sizes[s]);
+				if (filter != NULL && strstr(name,filter) == NULL) continue;
+				if (!cpu_has(kernels[k].needs)) continue;
+
+				// one untimed pass to warm the cache and check the answer
+				hits = kernels[k].fn(buf,sizes[s]);
+				if (hits != expect)
+				{
+					printf("%-32s found %ld tags, memchr found %ld\n",name,hits,expect);
+					failed = 1;
+					continue;
+				}
+
+				iters = 0;
+				w0 = now(CLOCK_MONOTONIC);
+				c0 = now(CLOCK_PROCESS_CPUTIME_ID);
+				do
+				{
+					hits += kernels[k].fn(buf,sizes[s]);
+					iters++;
+					wall = now(CLOCK_MONOTONIC) - w0;
+				} while (wall < min_time);
+				cpu = now(CLOCK_PROCESS_CPUTIME_ID) - c0;
+
+				printf("%-32s %10.0f ns %10.0f ns %12ld",name,wall / iters * 1e9,cpu / iters * 1e9,iters);
+				print_rate(sizes[s] * iters / wall,"B/s");
+				printf("  %10ld\n",expect);
+			}
+		}
+	}
+
+	free(buf);
+	return failed;
+}
@@ -0,0 +1,218 @@
+// sigscan.h - signature scanner for midi-carver
+//  finds "MThd" and "MTrk" tags in a block of bytes
+//
+//  Every kernel works the same way: find offsets where "MT" starts, then
+//   look at the next two bytes to tell a header ("hd") from a track ("rk").
+//   The vector kernels test 64 offsets per step; on x86 the best one the CPU
+//   supports is picked the first time sig_next is called.
+//
+//  sig_zeros does the same for runs of zero bytes, so unused space on an
+//   image can be stepped over faster than it could be searched.
+
+#ifndef SIGSCAN_H
+#define SIGSCAN_H
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIGSCAN_X86
+#endif
+
+#define SIG_NONE 0
+#define SIG_MTHD 1
+#define SIG_MTRK 2
+
+// What kind of tag starts at p?  Needs 4 readable bytes.
+static inline int sig_at(const unsigned char *p)
+{
+	if (p[0] != 'M' || p[1] != 'T') return SIG_NONE;
+	if (p[2] == 'h' && p[3] == 'd') return SIG_MTHD;
+	if (p[2] == 'r' && p[3] == 'k') return SIG_MTRK;
+	return SIG_NONE;
+}
+
+// All kernels share this contract: return the first offset p >= i with
+//  p + 4 <= end that holds a tag, and store its kind.  -1 if there is none.
+
+// Portable version.  libc's memchr is already vectorized on most platforms,
+//  so this is a reasonable fallback rather than a byte-at-a-time loop.
+static long sig_next_scalar(const unsigned char *buf, long i, long end, int *kind)
+{
+	const unsigned char *p;
+
+	while (i + 4 <= end)
+	{
+		p = memchr(&buf[i],'M',end - 3 - i);
+		if (p == NULL) return -1;
+		i = p - buf;
+		if ((*kind = sig_at(p)) != SIG_NONE) return i;
+		i++;
+	}
+	return -1;
+}
+
+// The zero kernels return the first offset p >= i such that [i, p) is all
+//  zero bytes, moving in whole 64-byte blocks: p is i plus a multiple of 64,
+//  and stops short of a block that isn't all zero or doesn't fit before end.
+static long sig_zeros_scalar(const unsigned char *buf, long i, long end)
+{
+	unsigned long long w[8];
+	int k;
+
+	while (i + 64 <= end)
+	{
+		memcpy(w,&buf[i],64);
+		for (k = 1; k < 8; k++)
+			w[0] |= w[k];
+		if (w[0] != 0) break;
+		i += 64;
+	}
+	return i;
+}
+
+#ifdef SIGSCAN_X86
+// Checks each "MT" position in a 64-bit hit mask, lowest offset first.
+static inline long sig_check_mask(const unsigned char *buf, long i, unsigned long long mask, int *kind)
+{
+	int bit;
+
+	while (mask)
+	{
+		bit = __builtin_ctzll(mask);
+		if ((*kind = sig_at(&buf[i + bit])) != SIG_NONE) return i + bit;
+		mask &= mask - 1;
+	}
+	return -1;
+}
+
+__attribute__((target("sse2")))
+static long sig_next_sse2(const unsigned char *buf, long i, long end, int *kind)
+{
+	const __m128i m = _mm_set1_epi8('M'), t = _mm_set1_epi8('T');
+	unsigned long long mask;
+	long hit;
+	int k;
+
+	// a block reads 65 bytes and may report a tag at its last offset
+	while (i + 67 <= end)
+	{
+		mask = 0;
+		for (k = 0; k < 4; k++)
+		{
+			__m128i a = _mm_loadu_si128((const __m128i *)&buf[i + k * 16]);
+			__m128i b = _mm_loadu_si128((const __m128i *)&buf[i + k * 16 + 1]);
+			unsigned int bits = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a,m),_mm_cmpeq_epi8(b,t)));
+			mask |= (unsigned long long)bits << (k * 16);
+		}
+		if (mask && (hit = sig_check_mask(buf,i,mask,kind)) >= 0) return hit;
+		i += 64;
+	}
+	return sig_next_scalar(buf,i,end,kind);
+}
+
+__attribute__((target("avx2")))
+static long sig_next_avx2(const unsigned char *buf, long i, long end, int *kind)
+{
+	const __m256i m = _mm256_set1_epi8('M'), t = _mm256_set1_epi8('T');
+	unsigned long long mask;
+	long hit;
+
+	while (i + 67 <= end)
+	{
+		__m256i a0 = _mm256_loadu_si256((const __m256i *)&buf[i]);
+		__m256i b0 = _mm256_loadu_si256((const __m256i *)&buf[i + 1]);
+		__m256i a1 = _mm256_loadu_si256((const __m256i *)&buf[i + 32]);
+		__m256i b1 = _mm256_loadu_si256((const __m256i *)&buf[i + 33]);
+		unsigned int lo = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a0,m),_mm256_cmpeq_epi8(b0,t)));
+		unsigned int hi = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a1,m),_mm256_cmpeq_epi8(b1,t)));
+
+		mask = ((unsigned long long)hi << 32) | lo;
+		if (mask && (hit = sig_check_mask(buf,i,mask,kind)) >= 0) return hit;
+		i += 64;
+	}
+	return sig_next_scalar(buf,i,end,kind);
+}
+
+__attribute__((target("sse2")))
+static long sig_zeros_sse2(const unsigned char *buf, long i, long end)
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	while (i + 64 <= end)
+	{
+		__m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *)&buf[i]),_mm_loadu_si128((const __m128i *)&buf[i + 16]));
+		__m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i *)&buf[i + 32]),_mm_loadu_si128((const __m128i *)&buf[i + 48]));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(a,b),zero)) != 0xFFFF) break;
+		i += 64;
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static long sig_zeros_avx2(const unsigned char *buf, long i, long end)
+{
+	while (i + 64 <= end)
+	{
+		__m256i a = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)&buf[i]),_mm256_loadu_si256((const __m256i *)&buf[i + 32]));
+
+		if (!_mm256_testz_si256(a,a)) break;
+		i += 64;
+	}
+	return i;
+}
+#endif
+
+static long sig_next_init(const unsigned char *buf, long i, long end, int *kind);
+
+// The scanner.  Starts out pointing at sig_next_init, which swaps in the
+//  best kernel for this CPU on first use.
+static long (*sig_next)(const unsigned char *buf, long i, long end, int *kind) = sig_next_init;
+
+static long sig_zeros_init(const unsigned char *buf, long i, long end);
+
+// The zero-run finder, picked along with sig_next.
+static long (*sig_zeros)(const unsigned char *buf, long i, long end) = sig_zeros_init;
+
+// Name of the kernel sig_next is using.
+static const char *sig_kernel = "scalar";
+
+// Picks the best kernel for this CPU.  Safe to call more than once.
+static void sig_select(void)
+{
+#ifdef SIGSCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		sig_kernel = "avx2";
+		sig_next = sig_next_avx2;
+		sig_zeros = sig_zeros_avx2;
+		return;
+	}
+	if (__builtin_cpu_supports("sse2"))
+	{
+		sig_kernel = "sse2";
+		sig_next = sig_next_sse2;
+		sig_zeros = sig_zeros_sse2;
+		return;
+	}
+#endif
+	sig_kernel = "scalar";
+	sig_next = sig_next_scalar;
+	sig_zeros = sig_zeros_scalar;
+}
+
+static long sig_next_init(const unsigned char *buf, long i, long end, int *kind)
+{
+	sig_select();
+	return sig_next(buf,i,end,kind);
+}
+
+static long sig_zeros_init(const unsigned char *buf, long i, long end)
+{
+	sig_select();
+	return sig_zeros(buf,i,end);
+}
+
+#endif
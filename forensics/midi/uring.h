@@ -0,0 +1,178 @@
+// uring.h - minimal io_uring wrapper for midi-carver
+//  just enough of the interface to keep many reads in flight, made with the
+//  raw system calls so there's no liburing to install
+//
+//  Only Linux has io_uring; everywhere else (and on kernels without it, or
+//   where it's been turned off) uring_init fails and the caller falls back
+//   to pread.  Before 5.6 the ring sets up but has no IORING_OP_READ: the
+//   first read comes back -EINVAL, and the caller falls back then.
+
+#ifndef URING_H
+#define URING_H
+
+#include <string.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define URING_OK
+#endif
+
+struct uring
+{
+	int fd;
+	unsigned entries;
+#ifdef URING_OK
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_len, cq_len, sqes_len;
+	unsigned queued;	// sqes filled in but not yet submitted
+#endif
+};
+
+#ifdef URING_OK
+// Sets up a ring for at least entries requests.  0 on success, -1 if the
+//  kernel won't give us one.
+static int uring_init(struct uring *r, unsigned entries)
+{
+	struct io_uring_params p;
+	unsigned char *sq,*cq;
+
+	memset(r,0,sizeof(*r));
+	memset(&p,0,sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup,entries,&p);
+	if (r->fd < 0) return -1;
+	r->entries = p.sq_entries;
+
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	r->sq_ring = mmap(NULL,r->sq_len,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,r->fd,IORING_OFF_SQ_RING);
+	r->cq_ring = mmap(NULL,r->cq_len,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,r->fd,IORING_OFF_CQ_RING);
+	r->sqes = mmap(NULL,r->sqes_len,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,r->fd,IORING_OFF_SQES);
+	if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED)
+	{
+		if (r->sq_ring != MAP_FAILED) munmap(r->sq_ring,r->sq_len);
+		if (r->cq_ring != MAP_FAILED) munmap(r->cq_ring,r->cq_len);
+		if (r->sqes != MAP_FAILED) munmap(r->sqes,r->sqes_len);
+		close(r->fd);
+		return -1;
+	}
+
+	sq = r->sq_ring;
+	cq = r->cq_ring;
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+}
+
+static void uring_free(struct uring *r)
+{
+	munmap(r->sq_ring,r->sq_len);
+	munmap(r->cq_ring,r->cq_len);
+	munmap(r->sqes,r->sqes_len);
+	close(r->fd);
+}
+
+// Queues a read of len bytes at file offset off into buf.  Nothing is sent
+//  to the kernel until uring_submit.  -1 if the submission queue is full.
+static int uring_read(struct uring *r, int fd, void *buf, unsigned len, long off, unsigned long long tag)
+{
+	unsigned tail = *r->sq_tail,idx;
+	struct io_uring_sqe *sqe;
+
+	if (tail + r->queued - __atomic_load_n(r->sq_head,__ATOMIC_ACQUIRE) >= r->entries) return -1;
+
+	idx = (tail + r->queued) & *r->sq_mask;
+	sqe = &r->sqes[idx];
+	memset(sqe,0,sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = tag;
+	r->sq_array[idx] = idx;
+	r->queued++;
+	return 0;
+}
+
+// Sends queued reads to the kernel and, if wait is set, blocks until at
+//  least one request has completed.  -1 on error.
+static int uring_submit(struct uring *r, int wait)
+{
+	unsigned n = r->queued;
+	int got;
+
+	__atomic_store_n(r->sq_tail,*r->sq_tail + n,__ATOMIC_RELEASE);
+	r->queued = 0;
+	do
+		got = syscall(__NR_io_uring_enter,r->fd,n,wait ? 1 : 0,wait ? IORING_ENTER_GETEVENTS : 0,NULL,0);
+	while (got < 0 && errno == EINTR);
+	return got < 0 ? -1 : 0;
+}
+
+// Takes one completion off the ring if there is one: 1 and its tag and
+//  result (bytes read, or -errno), or 0.
+static int uring_reap(struct uring *r, unsigned long long *tag, int *res)
+{
+	unsigned head = *r->cq_head;
+	struct io_uring_cqe *cqe;
+
+	if (head == __atomic_load_n(r->cq_tail,__ATOMIC_ACQUIRE)) return 0;
+	cqe = &r->cqes[head & *r->cq_mask];
+	*tag = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(r->cq_head,head + 1,__ATOMIC_RELEASE);
+	return 1;
+}
+#else
+static int uring_init(struct uring *r, unsigned entries)
+{
+	(void)r;
+	(void)entries;
+	return -1;
+}
+
+static void uring_free(struct uring *r)
+{
+	(void)r;
+}
+
+static int uring_read(struct uring *r, int fd, void *buf, unsigned len, long off, unsigned long long tag)
+{
+	(void)r; (void)fd; (void)buf; (void)len; (void)off; (void)tag;
+	return -1;
+}
+
+static int uring_submit(struct uring *r, int wait)
+{
+	(void)r;
+	(void)wait;
+	return -1;
+}
+
+static int uring_reap(struct uring *r, unsigned long long *tag, int *res)
+{
+	(void)r; (void)tag; (void)res;
+	return 0;
+}
+#endif
+
+#endif
@@ -0,0 +1,145 @@
+// xxh64.h - XXH64 hash for midi-carver
+//  streaming version of Yann Collet's xxHash, 64-bit variant, seed 0
+//
+//  Output files are laid out as a list of pieces (headers, track bytes in
+//   the image, repair suffixes), so the hash is fed piece by piece instead
+//   of needing the whole file in one buffer.
+
+#ifndef XXH64_H
+#define XXH64_H
+
+#include <string.h>
+
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+
+struct xxh64
+{
+	unsigned long long v[4];
+	unsigned long long total;
+	unsigned char buf[32];	// input not yet making up a whole stripe
+	int n;
+};
+
+static inline unsigned long long xxh_rotl(unsigned long long x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+// Little-endian loads, whatever the host is.
+static inline unsigned long long xxh_read64(const unsigned char *p)
+{
+	return (unsigned long long)p[0] | ((unsigned long long)p[1] << 8) |
+		((unsigned long long)p[2] << 16) | ((unsigned long long)p[3] << 24) |
+		((unsigned long long)p[4] << 32) | ((unsigned long long)p[5] << 40) |
+		((unsigned long long)p[6] << 48) | ((unsigned long long)p[7] << 56);
+}
+
+static inline unsigned long long xxh_read32(const unsigned char *p)
+{
+	return (unsigned long long)p[0] | ((unsigned long long)p[1] << 8) |
+		((unsigned long long)p[2] << 16) | ((unsigned long long)p[3] << 24);
+}
+
+static inline unsigned long long xxh_round(unsigned long long acc, unsigned long long in)
+{
+	acc += in * XXH_P2;
+	acc = xxh_rotl(acc,31);
+	return acc * XXH_P1;
+}
+
+static inline unsigned long long xxh_merge(unsigned long long acc, unsigned long long v)
+{
+	acc ^= xxh_round(0,v);
+	return acc * XXH_P1 + XXH_P4;
+}
+
+static void xxh64_init(struct xxh64 *s)
+{
+	s->v[0] = XXH_P1 + XXH_P2;
+	s->v[1] = XXH_P2;
+	s->v[2] = 0;
+	s->v[3] = -XXH_P1;
+	s->total = 0;
+	s->n = 0;
+}
+
+static void xxh64_update(struct xxh64 *s, const unsigned char *p, size_t len)
+{
+	int k;
+
+	s->total += len;
+
+	// top up a partial stripe first
+	if (s->n > 0)
+	{
+		k = 32 - s->n;
+		if (len < (size_t)k)
+		{
+			memcpy(&s->buf[s->n],p,len);
+			s->n += len;
+			return;
+		}
+		memcpy(&s->buf[s->n],p,k);
+		p += k;
+		len -= k;
+		for (k = 0; k < 4; k++)
+			s->v[k] = xxh_round(s->v[k],xxh_read64(&s->buf[k * 8]));
+		s->n = 0;
+	}
+
+	while (len >= 32)
+	{
+		s->v[0] = xxh_round(s->v[0],xxh_read64(p));
+		s->v[1] = xxh_round(s->v[1],xxh_read64(p + 8));
+		s->v[2] = xxh_round(s->v[2],xxh_read64(p + 16));
+		s->v[3] = xxh_round(s->v[3],xxh_read64(p + 24));
+		p += 32;
+		len -= 32;
+	}
+
+	memcpy(s->buf,p,len);
+	s->n = len;
+}
+
+static unsigned long long xxh64_final(const struct xxh64 *s)
+{
+	unsigned long long h;
+	const unsigned char *p = s->buf;
+	int left = s->n;
+
+	if (s->total >= 32)
+	{
+		h = xxh_rotl(s->v[0],1) + xxh_rotl(s->v[1],7) + xxh_rotl(s->v[2],12) + xxh_rotl(s->v[3],18);
+		h = xxh_merge(h,s->v[0]);
+		h = xxh_merge(h,s->v[1]);
+		h = xxh_merge(h,s->v[2]);
+		h = xxh_merge(h,s->v[3]);
+	} else
+		h = XXH_P5;
+
+	h += s->total;
+
+	for (; left >= 8; left -= 8, p += 8)
+		h = xxh_rotl(h ^ xxh_round(0,xxh_read64(p)),27) * XXH_P1 + XXH_P4;
+	if (left >= 4)
+	{
+		h = xxh_rotl(h ^ (xxh_read32(p) * XXH_P1),23) * XXH_P2 + XXH_P3;
+		p += 4;
+		left -= 4;
+	}
+	for (; left > 0; left--, p++)
+		h = xxh_rotl(h ^ (*p * XXH_P5),11) * XXH_P1;
+
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	h ^= h >> 32;
+	return h;
+}
+
+#endif